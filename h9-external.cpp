@@ -15,11 +15,166 @@
     along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
 
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cstdarg>
+#include <map>
+#include <utility>
+#include <vector>
 #include "c74_max.h"
+#include "h9-sysex.h"
 #include "libh9.h"
 
 using namespace c74::max;
 
+////////////////////////// logging
+
+typedef enum loglevel {
+    kLogLevel_Off = 0U,
+    kLogLevel_Error,
+    kLogLevel_Warning,
+    kLogLevel_Info,
+    kLogLevel_Debug,
+} loglevel;
+
+// Anything more verbose than this is compiled out entirely, regardless of the loglevel attribute.
+#ifndef H9_LOG_MAX_LEVEL
+#ifdef NDEBUG
+#define H9_LOG_MAX_LEVEL kLogLevel_Info
+#else
+#define H9_LOG_MAX_LEVEL kLogLevel_Debug
+#endif
+#endif
+
+#define LOG_RING_SIZE 64U  // Must be a power of two
+#define LOG_MSG_LEN   128U
+
+// One slot in the log ring. The sequence number tells producers and the consumer who owns the slot.
+typedef struct log_entry {
+    std::atomic<size_t> sequence;
+    loglevel            level;
+    char                message[LOG_MSG_LEN];
+} log_entry;
+
+// Bounded lock-free ring: any thread may write, only the main-thread qelem reads.
+typedef struct log_ring {
+    log_entry           entries[LOG_RING_SIZE];
+    std::atomic<size_t> write_pos;
+    size_t              read_pos;
+    std::atomic<size_t> dropped;
+} log_ring;
+
+// Level checks happen before the arguments are evaluated, so filtered messages cost a compare (or nothing).
+#define LOG_AT(x, level, ...)                                          \
+    do {                                                               \
+        if ((level) <= H9_LOG_MAX_LEVEL && (level) <= (x)->loglevel) { \
+            log_enqueue((x), (level), __VA_ARGS__);                    \
+        }                                                              \
+    } while (0)
+
+#define LOG_ERROR(x, ...)   LOG_AT(x, kLogLevel_Error, __VA_ARGS__)
+#define LOG_WARNING(x, ...) LOG_AT(x, kLogLevel_Warning, __VA_ARGS__)
+#define LOG_INFO(x, ...)    LOG_AT(x, kLogLevel_Info, __VA_ARGS__)
+#define LOG_DEBUG(x, ...)   LOG_AT(x, kLogLevel_Debug, __VA_ARGS__)
+
+////////////////////////// preset similarity index
+
+#define INDEX_DIMS         (NUM_CONTROLS + 3 * H9_NUM_KNOBS)  // Controls, then exp_min, exp_max and psw per knob
+#define MAX_PRESET_FILE_SZ 65536
+
+// All the indexed presets for one module/algorithm. Only presets sharing an algorithm are comparable,
+// so a query only ever scans one partition. Vectors are stored column-wise (one array per dimension)
+// so the distance kernel streams contiguous floats.
+typedef struct index_partition {
+    uint8_t             module;
+    uint8_t             algorithm;
+    std::vector<t_atom> labels;  // Slot number or file name, output as-is
+    std::vector<float>  columns[INDEX_DIMS];
+} index_partition;
+
+typedef std::pair<long, intptr_t> index_key;  // Atom type and value, so slots and names never collide
+
+typedef struct index_location {
+    size_t partition;
+    size_t row;
+} index_location;
+
+typedef struct preset_index {
+    std::vector<index_partition>        partitions;
+    std::map<index_key, index_location> locations;  // Where each label lives, for replace/remove
+    std::vector<float>                  distances;  // Scratch for queries
+    std::vector<uint32_t>               order;      // Scratch for queries
+} preset_index;
+
+// One preset found by a folder scan, waiting to be merged into the index on the main thread.
+typedef struct index_entry {
+    t_symbol *label;
+    uint8_t   module;
+    uint8_t   algorithm;
+    float     vector[INDEX_DIMS];
+} index_entry;
+
+////////////////////////// device presence watchdog
+
+#define WATCHDOG_MISSES        2   // Unanswered probes before the device is declared offline
+#define WATCHDOG_ONLINE_FACTOR 4   // While online, quiet-link backoff stops at this multiple of the base interval
+#define WATCHDOG_PROBE_SZ      32  // Room for the probe request as generated by libh9
+#define SYSEX_HEADER_LEN       5   // F0, manufacturer, model, sysex id, command
+
+////////////////////////// transactions
+
+// State messages that a change needs to publish. Inside begin/commit they accumulate and go out once.
+typedef enum publish_flags {
+    kPublish_None       = 0U,
+    kPublish_Module     = 1U << 0,
+    kPublish_Algorithms = 1U << 1,
+    kPublish_Algorithm  = 1U << 2,
+    kPublish_PresetName = 1U << 3,
+    kPublish_Name       = 1U << 4,
+    kPublish_RxChannel  = 1U << 5,
+    kPublish_TxChannel  = 1U << 6,
+    kPublish_Dirty      = 1U << 7,
+    kPublish_Dump       = 1U << 8,  // The preset sysex itself, so a dump requested mid-transaction goes out once
+} publish_flags;
+
+#define NUM_MIDI_CCS   128
+#define CC_NO_PENDING  -1
+#define PRESET_DUMP_SZ 1000  // Also sizes the dump_preset cache
+#define TXN_WARN_MS    1000  // Warn if a transaction is still open after this long
+
+////////////////////////// automation
+
+#define AUTOMATION_NONE -1  // No quantized value yet
+
+// One breakpoint lane per control. Ticks are sorted ascending; values are 0..1 and parallel to ticks.
+typedef struct automation_lane {
+    std::vector<double> ticks;
+    std::vector<float>  values;
+} automation_lane;
+
+typedef struct automation_event {
+    double  tick;
+    uint8_t control;
+    uint8_t value;  // Quantized to CC resolution, 0..127
+} automation_event;
+
+typedef struct automation {
+    automation_lane               lanes[NUM_CONTROLS];
+    std::vector<automation_event> events;      // Pre-rendered window, sorted by tick
+    size_t                        next_event;  // First event not yet fired
+    double                        rendered_to;
+    double                        last_ticks;  // Transport position at the previous wake, to spot seeks
+    int16_t                       fired[NUM_CONTROLS];     // Last value actually sent per control
+    int16_t                       rendered[NUM_CONTROLS];  // Last value rendered per control
+    std::vector<automation_event> scratch;                 // Reused render buffer, so the scheduler doesn't allocate under the lock
+} automation;
+
+// Tick order, with ties in control order, so an unstable sort still gives a deterministic schedule.
+static inline bool automation_event_before(const automation_event &a, const automation_event &b) {
+    return a.tick < b.tick || (a.tick == b.tick && a.control < b.control);
+}
+
 ////////////////////////// object struct
 
 typedef enum knobmode {
@@ -38,6 +193,11 @@ typedef struct _h9_external {
 
     knobmode knobmode;
 
+    // Logging
+    t_atom_long loglevel;  // Attribute, see loglevel enum
+    log_ring    log;
+    void *      log_qelem;  // Flushes the log ring to the Max console at low priority
+
     // Listed Right to Left
     void *m_outlet_enabled;  // Unused for now, will be used for M4L instance syncing
     void *m_outlet_cc;       // Outputs CC as a list [CC Value]
@@ -46,6 +206,72 @@ typedef struct _h9_external {
 
     // libh9 object
     h9 *h9;
+
+    // find_similar
+    preset_index *             index;
+    t_systhread                index_thread;  // Scans a folder for "index folder", NULL when idle
+    void *                     index_qelem;   // Merges a finished scan on the main thread
+    short                      index_path;    // Folder being scanned
+    std::atomic<bool>          index_cancel;  // Scan results are to be thrown away
+    std::vector<index_entry> * index_scan;    // Presets found so far by the running scan
+
+    // Device presence watchdog
+    t_atom_long   watchdog_interval;   // Attribute: base poll interval in ms, 0 disables
+    t_atom_long   watchdog_max;        // Attribute: backoff ceiling in ms
+    t_atom_long   watchdog_variable;   // Attribute: config variable address requested as the probe
+    void *        watchdog_clock;
+    long          watchdog_delay;      // Current (backed off) interval
+    long          missed_probes;
+    bool          device_online;
+    bool          probe_pending;
+    bool          heard_since_tick;    // Anything at all, including a probe reply
+    bool          traffic_since_tick;  // Anything that wasn't a probe reply
+    unsigned long probe_sent;
+    unsigned long last_heard;
+    long          latency;             // Round trip of the most recent answered probe, 0 if none since reconnecting
+    bool          offline_edits;       // The preset was changed while the device was offline
+    bool          capturing_probe;     // The next outgoing sysex is our probe request
+    size_t        probe_request_len;
+    uint8_t       probe_request[WATCHDOG_PROBE_SZ];  // Kept to recognize the reply
+
+    // Transactions (begin/commit)
+    long                   txn_depth;
+    uint32_t               txn_publish;                // publish_flags accumulated since begin
+    int16_t                txn_cc[NUM_MIDI_CCS];       // Last value sent per CC, or CC_NO_PENDING
+    bool                   txn_control[NUM_CONTROLS];  // Controls whose display changed
+    bool                   txn_failed;                 // A sub-command was rejected; commit rolls back
+    void *                 txn_clock;                  // Warns about a transaction left open
+    std::vector<uint8_t> * txn_sysex;                  // Outgoing sysex held until commit, back to back
+    size_t                 txn_snapshot_len;           // Preset as it was at begin, 0 if none was loaded
+    uint8_t                txn_snapshot[PRESET_DUMP_SZ];
+    uint8_t                txn_module;                 // With no preset loaded to dump, the model is snapshotted field by field
+    uint8_t                txn_algorithm;
+    control_value          txn_controls[NUM_CONTROLS];
+    control_value          txn_exp_min[H9_NUM_KNOBS];
+    control_value          txn_exp_max[H9_NUM_KNOBS];
+    control_value          txn_psw[H9_NUM_KNOBS];
+    uint8_t                txn_cc_rx_map[NUM_CONTROLS];
+    uint8_t                txn_cc_tx_map[NUM_CONTROLS];
+    uint8_t                txn_sysex_id;
+    uint8_t                txn_rx_channel;
+    uint8_t                txn_tx_channel;
+
+    // Transport-synced automation
+    automation *automation;
+    t_itm *     itm;
+    void *      automation_clock;
+    t_critical  automation_lock;  // Guards the lanes and the rendered window between main thread and scheduler
+    bool        automation_running;
+    t_atom_long lookahead;         // Attribute: render window in ms
+    t_atom_long automation_grain;  // Attribute: sampling step in ticks
+
+    // dump_preset cache, valid while dump_generation == generation
+    uint64_t generation;  // Bumped by every path that changes the preset model
+    uint64_t dump_generation;
+    bool     dump_busy;  // Set while the cached list is being output, in case something downstream re-enters
+    size_t   dump_len;
+    uint8_t  dump_sysex[PRESET_DUMP_SZ];
+    t_atom   dump_atoms[PRESET_DUMP_SZ];
 } t_h9_external;
 
 static t_class *h9_external_class = nullptr;
@@ -62,19 +288,45 @@ void h9_external_int(t_h9_external *x, long n);
 void h9_external_set(t_h9_external *x, t_symbol *s, long ac, t_atom *av);
 void h9_external_list(t_h9_external *x, t_symbol *s, long argc, t_atom *argv);
 void h9_external_get(t_h9_external *x, t_symbol *s, long argc, t_atom *argv);
+void h9_external_index(t_h9_external *x, t_symbol *s, long argc, t_atom *argv);
+void h9_external_begin(t_h9_external *x);
+void h9_external_commit(t_h9_external *x);
+void h9_external_abort(t_h9_external *x);
+void h9_external_automation(t_h9_external *x, t_symbol *s, long argc, t_atom *argv);
+void h9_external_find_similar(t_h9_external *x, long k);
 
 static void h9_cc_callback_handler(void *ctx, uint8_t midi_channel, uint8_t cc, uint8_t msb, uint8_t lsb);
 static void h9_sysex_callback_handler(void *ctx, uint8_t *sysex, size_t len);
 static void h9_display_callback_handler(void *ctx, control_id control, control_value current_value, control_value display_value);
 
+static void log_init(t_h9_external *x);
+static void log_enqueue(t_h9_external *x, loglevel level, const char *fmt, ...);
+static void log_flush(t_h9_external *x);
+
 static void output_sysex(t_h9_external *x, uint8_t *sysex, size_t len);
 static void output_state(t_h9_external *x, t_symbol *s, long argc, t_atom *argv);
 
 static void input_midi(t_h9_external *x, long argc, t_atom *argv);
+
+static t_max_err watchdog_attr_set(t_h9_external *x, void *attr, long argc, t_atom *argv);
+static void      watchdog_tick(t_h9_external *x);
+static bool      watchdog_heard(t_h9_external *x, bool probe_reply);
+static bool      watchdog_is_probe_reply(t_h9_external *x, const uint8_t *sysex, size_t len);
+static void      watchdog_reconnected(t_h9_external *x);
+static void      watchdog_resync(t_h9_external *x);
+static void      send_online(t_h9_external *x);
 static void input_control(t_h9_external *x, long argc, t_atom *argv);
 
+static void model_changed(t_h9_external *x);
 static void dump_preset(t_h9_external *x);
 
+static void publish(t_h9_external *x, uint32_t flags);
+static void txn_reject(t_h9_external *x);
+static void txn_held_open(t_h9_external *x);
+static void txn_snapshot(t_h9_external *x);
+static void txn_restore(t_h9_external *x);
+static void txn_discard(t_h9_external *x);
+static void txn_rollback(t_h9_external *x);
 static void send_control(t_h9_external *x, control_id control, control_value current_value, control_value display_value);
 static void send_knobmode(t_h9_external *x);
 static void send_rx_cc(t_h9_external *x);
@@ -91,20 +343,114 @@ static void send_preset_name(t_h9_external *x);
 static void request_device_config(t_h9_external *x);
 static void request_device_program(t_h9_external *x);
 static bool validate_atom_as_cc(t_atom *atom, uint8_t *cc);
-static void set_midi_cc(t_h9_external *x, uint8_t *cc_map, long argc, t_atom *argv);
-static void set_midi_rx_channel(t_h9_external *x, long argc, t_atom *argv);
-static void set_midi_tx_channel(t_h9_external *x, long argc, t_atom *argv);
-static void set_sysex_id(t_h9_external *x, long argc, t_atom *argv);
-static void set_module(t_h9_external *x, long argc, t_atom *argv);
-static void set_algorithm(t_h9_external *x, long argc, t_atom *argv);
+static bool set_midi_cc(t_h9_external *x, uint8_t *cc_map, long argc, t_atom *argv);
+static bool set_midi_rx_channel(t_h9_external *x, long argc, t_atom *argv);
+static bool set_midi_tx_channel(t_h9_external *x, long argc, t_atom *argv);
+static bool set_sysex_id(t_h9_external *x, long argc, t_atom *argv);
+static bool set_module(t_h9_external *x, long argc, t_atom *argv);
+static bool set_algorithm(t_h9_external *x, long argc, t_atom *argv);
 static void set_knobmode(t_h9_external *x, long argc, t_atom *argv);
-static void set_control(t_h9_external *x, long argc, t_atom *argv);
-static void set_preset_name(t_h9_external *x, long argc, t_atom *argv);
+static bool set_control(t_h9_external *x, long argc, t_atom *argv);
+static bool set_preset_name(t_h9_external *x, long argc, t_atom *argv);
+
+static void   preset_vector(h9 *h9obj, float *vector);
+static index_key index_label_key(t_atom *label);
+static void   index_remove(preset_index *index, t_atom *label);
+static void   index_insert(preset_index *index, t_atom *label, uint8_t module, uint8_t algorithm, const float *vector);
+static size_t index_query(preset_index *index, uint8_t module, uint8_t algorithm, const float *query, size_t k, t_atom *results);
+static void   index_scan_folder(t_h9_external *x, h9 *scratch, short path, const char *prefix);
+static void * index_scan_thread(t_h9_external *x);
+static void   index_scan_done(t_h9_external *x);
+static void   index_scan_stop(t_h9_external *x);
+static bool   has_syx_extension(const char *filename);
+static void   index_add_current(t_h9_external *x, long argc, t_atom *argv);
+static void   send_index_size(t_h9_external *x);
+
+static bool  automation_active(automation *automation);
+static float automation_value_at(automation_lane *lane, double tick, size_t *cursor);
+static void  automation_render(t_h9_external *x, size_t control, double from, double to, std::vector<automation_event> *out);
+static void  automation_invalidate(t_h9_external *x, long control, double from);
+static void  automation_tick(t_h9_external *x);
+static void  automation_set_lane(t_h9_external *x, long argc, t_atom *argv);
+static void  automation_add_point(t_h9_external *x, long argc, t_atom *argv);
+
+// Logging
+static void log_init(t_h9_external *x) {
+    for (size_t i = 0; i < LOG_RING_SIZE; i++) {
+        x->log.entries[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    x->log.write_pos.store(0, std::memory_order_relaxed);
+    x->log.read_pos = 0;
+    x->log.dropped.store(0, std::memory_order_relaxed);
+}
+
+// Safe to call from any thread. Formats straight into a ring slot; never touches the console.
+static void log_enqueue(t_h9_external *x, loglevel level, const char *fmt, ...) {
+    log_ring * ring = &x->log;
+    log_entry *entry;
+    size_t     pos = ring->write_pos.load(std::memory_order_relaxed);
+    for (;;) {
+        entry        = &ring->entries[pos & (LOG_RING_SIZE - 1)];
+        size_t   seq = entry->sequence.load(std::memory_order_acquire);
+        intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+        if (dif == 0) {
+            if (ring->write_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (dif < 0) {
+            // Full; the flush hasn't caught up. Count it rather than block.
+            ring->dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        } else {
+            pos = ring->write_pos.load(std::memory_order_relaxed);
+        }
+    }
+
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(entry->message, LOG_MSG_LEN, fmt, args);
+    va_end(args);
+    entry->level = level;
+    entry->sequence.store(pos + 1, std::memory_order_release);
+
+    qelem_set(x->log_qelem);
+}
+
+// Runs as a qelem on the main thread and drains everything queued since the last run in one go.
+static void log_flush(t_h9_external *x) {
+    log_ring *ring = &x->log;
+    for (;;) {
+        log_entry *entry = &ring->entries[ring->read_pos & (LOG_RING_SIZE - 1)];
+        if (entry->sequence.load(std::memory_order_acquire) != ring->read_pos + 1) {
+            break;
+        }
+        switch (entry->level) {
+            case kLogLevel_Error:
+                object_error((t_object *)x, "%s", entry->message);
+                break;
+            case kLogLevel_Warning:
+                object_warn((t_object *)x, "%s", entry->message);
+                break;
+            default:
+                object_post((t_object *)x, "%s", entry->message);
+        }
+        entry->sequence.store(ring->read_pos + LOG_RING_SIZE, std::memory_order_release);
+        ring->read_pos++;
+    }
+    size_t dropped = ring->dropped.exchange(0, std::memory_order_relaxed);
+    if (dropped > 0) {
+        object_warn((t_object *)x, "%zu log messages dropped.", dropped);
+    }
+}
 
 // Callback handlers
 static void h9_cc_callback_handler(void *ctx, uint8_t midi_channel, uint8_t cc, uint8_t msb, uint8_t lsb) {
     t_h9_external *x = (t_h9_external *)ctx;
-    t_atom         list[2];
+    if (x->txn_depth > 0 && cc < NUM_MIDI_CCS) {
+        x->txn_cc[cc] = msb;  // Only the final value per CC goes out on commit
+        return;
+    }
+    t_atom list[2];
     atom_setlong(&list[0], cc);
     atom_setlong(&list[1], msb);
     outlet_list(x->m_outlet_cc, gensym("list"), 2, list);
@@ -112,12 +458,24 @@ static void h9_cc_callback_handler(void *ctx, uint8_t midi_channel, uint8_t cc,
 
 static void h9_sysex_callback_handler(void *ctx, uint8_t *sysex, size_t len) {
     t_h9_external *x = (t_h9_external *)ctx;
+    if (x->capturing_probe) {
+        x->probe_request_len = std::min(len, (size_t)WATCHDOG_PROBE_SZ);
+        memcpy(x->probe_request, sysex, x->probe_request_len);
+    } else if (x->txn_depth > 0) {
+        // Held like everything else, so a rollback never has to undo something the device already got.
+        x->txn_sysex->insert(x->txn_sysex->end(), sysex, sysex + len);
+        return;
+    }
     output_sysex(x, sysex, len);
 }
 
 static void h9_display_callback_handler(void *ctx, control_id control, control_value current_value, control_value display_value) {
     t_h9_external *x = (t_h9_external *)ctx;
     if (x->knobmode == kKnobMode_Normal) {
+        if (x->txn_depth > 0 && control < NUM_CONTROLS) {
+            x->txn_control[control] = true;
+            return;
+        }
         send_control(x, control, display_value, current_value);
     }
 }
@@ -137,7 +495,7 @@ static void output_sysex(t_h9_external *x, uint8_t *sysex, size_t len) {
         // Big atom lists of sysex might be a bit large for the stack, so ask for heap
         t_atom *list = reinterpret_cast<t_atom *>(malloc(sizeof(t_atom) * len));
         if (list == NULL) {
-            object_post((t_object *)x, "Ran out of memory dumping sysex!");
+            LOG_ERROR(x, "Ran out of memory dumping sysex!");
             return;
         }
         for (size_t i = 0; i < len; i++) {
@@ -160,57 +518,69 @@ static void input_midi(t_h9_external *x, long argc, t_atom *argv) {
                 long cc    = atom_getlong(&argv[0]);
                 long value = atom_getlong(&argv[1]);
                 if ((cc > 100) || (value > 127)) {
-                    object_post((t_object *)x, "INPUT (list): CC number or value are too large.");
+                    LOG_WARNING(x, "INPUT (list): CC number or value are too large.");
                     return;
                 }
+                bool reconnected = watchdog_heard(x, false);
                 for (size_t i = 0; i < NUM_CONTROLS; i++) {
                     if (x->h9->midi_config.cc_tx_map[i] == (uint8_t)cc) {
                         float floatval = (float)((uint8_t)value) / 127.0f;
-                        object_post((t_object *)x, "INPUT (list): CC value (%d, %d) matched control %d, setting to %f.", (uint8_t)cc, (uint8_t)value, i, floatval);
+                        LOG_DEBUG(x, "INPUT (list): CC value (%d, %d) matched control %zu, setting to %f.", (uint8_t)cc, (uint8_t)value, i, floatval);
                         h9_setControl(x->h9, (control_id)i, floatval, kH9_TRIGGER_CALLBACK);  // Scale 0 to 1
+                        model_changed(x);
                         break;
                     }
                 }
+                if (reconnected) {
+                    watchdog_reconnected(x);
+                }
             } else {
                 // Scan the rest to make sure it's all longs <= UINT8_MAX, and treat as sysex
                 for (i = 0; i < argc; i++) {
                     if (atom_gettype(&argv[i]) != A_LONG) {
-                        object_post((t_object *)x, "INPUT (list): contains non-integer values, refusing to parse further.");
+                        LOG_WARNING(x, "INPUT (list): contains non-integer values, refusing to parse further.");
                         return;
                     }
                     long value = atom_getlong(&argv[i]);
                     if (value > UINT8_MAX) {
-                        object_post((t_object *)x, "INPUT (list): does not contain character-value integers, refusing to parse further.");
+                        LOG_WARNING(x, "INPUT (list): does not contain character-value integers, refusing to parse further.");
                         return;
                     }
                     list[i] = (char)value;
                 }
-                object_post((t_object *)x, "INPUT (list): Received list of %d characters.", i);
+                LOG_DEBUG(x, "INPUT (list): Received list of %ld characters.", i);
+                // Other sysex can't be told apart from what the patch feeds in itself (preset files, say),
+                // so only the answer to our own probe proves the device is there. It carries no model
+                // state, so it isn't parsed.
+                bool probe_reply = watchdog_is_probe_reply(x, (uint8_t *)list, i);
+                bool reconnected = probe_reply && watchdog_heard(x, true);
                 // TODO: Provide a means for the h9 parser to respond with the type of processed data
                 //       so we know what to refresh. Or set up observers?
-                if (h9_parse_sysex(x->h9, (uint8_t *)list, i, x->h9->midi_config.sysex_id == 0 ? kH9_RESPOND_TO_ANY_SYSEX_ID : kH9_RESTRICT_TO_SYSEX_ID) == kH9_OK) {
-                    object_post((t_object *)x, "INPUT (list): Successfully parsed sysex.", x->h9->preset->name);
-                    send_dirty(x);
-                    send_module(x);
-                    send_name(x);
-                    send_midi_rx_channel(x);
-                    send_midi_tx_channel(x);
-                    send_algorithms(x);
-                    send_algorithm(x);
-                    send_preset_name(x);
+                if (probe_reply) {
+                    LOG_DEBUG(x, "INPUT (list): Watchdog probe answered.");
+                } else if (h9_parse_sysex(x->h9, (uint8_t *)list, i, x->h9->midi_config.sysex_id == 0 ? kH9_RESPOND_TO_ANY_SYSEX_ID : kH9_RESTRICT_TO_SYSEX_ID) == kH9_OK) {
+                    model_changed(x);
+                    LOG_INFO(x, "INPUT (list): Successfully parsed sysex for preset '%s'.", x->h9->preset->name);
+                    publish(x, kPublish_Dirty | kPublish_Module | kPublish_Name | kPublish_RxChannel | kPublish_TxChannel | kPublish_Algorithms | kPublish_Algorithm | kPublish_PresetName);
                 } else {
-                    object_post((t_object *)x, "INPUT (list): Not a preset, ignored.");
+                    LOG_DEBUG(x, "INPUT (list): Not a preset, ignored.");
+                }
+                // Only after parsing, so the resync sees whatever the message that woke us carried.
+                if (reconnected) {
+                    watchdog_reconnected(x);
                 }
             }
             break;
         default:
             // No clue what it is, let's just ignore it
-            object_post((t_object *)x, "INPUT (list): format not recognized, ignoring.");
+            LOG_WARNING(x, "INPUT (list): format not recognized, ignoring.");
     }
 }
 
 static void input_control(t_h9_external *x, long argc, t_atom *argv) {
-    set_control(x, argc, argv);
+    if (!set_control(x, argc, argv)) {
+        txn_reject(x);
+    }
 }
 
 static void update_knobs(t_h9_external *x) {
@@ -252,10 +622,159 @@ static void update_knobs(t_h9_external *x) {
     }
 }
 
+// Call after anything that may change what h9_dump would produce.
+static void model_changed(t_h9_external *x) {
+    x->generation++;
+    if (x->watchdog_interval > 0 && !x->device_online) {
+        x->offline_edits = true;
+    }
+}
+
+// Only re-dumps when the model has changed since the last dump; otherwise the cached atoms go straight out.
 static void dump_preset(t_h9_external *x) {
-    uint8_t sysex_buffer[1000];
-    size_t  bytes_written = h9_dump(x->h9, sysex_buffer, 1000, true);
-    output_sysex(x, sysex_buffer, bytes_written);
+    if (x->txn_depth > 0) {
+        x->txn_publish |= kPublish_Dump;
+        return;
+    }
+    if (x->dump_busy) {
+        uint8_t sysex_buffer[PRESET_DUMP_SZ];
+        size_t  bytes_written = h9_dump(x->h9, sysex_buffer, PRESET_DUMP_SZ, true);
+        output_sysex(x, sysex_buffer, bytes_written);
+        return;
+    }
+    if (x->dump_generation != x->generation) {
+        x->dump_len = h9_dump(x->h9, x->dump_sysex, PRESET_DUMP_SZ, true);
+        for (size_t i = 0; i < x->dump_len; i++) {
+            atom_setlong(&x->dump_atoms[i], x->dump_sysex[i]);
+        }
+        x->dump_generation = x->generation;
+    }
+    if (x->dump_len > 0) {
+        x->dump_busy = true;
+        outlet_list(x->m_outlet_sysex, gensym("list"), x->dump_len, x->dump_atoms);
+        x->dump_busy = false;
+    }
+}
+
+// Sends the requested state messages now, or defers them to commit if a transaction is open.
+static void publish(t_h9_external *x, uint32_t flags) {
+    if (x->txn_depth > 0) {
+        x->txn_publish |= flags;
+        return;
+    }
+    if (flags & kPublish_Dump) {
+        dump_preset(x);  // First, since dumping clears the dirty flag
+    }
+    if (flags & kPublish_Dirty) {
+        send_dirty(x);
+    }
+    if (flags & kPublish_Module) {
+        send_module(x);
+    }
+    if (flags & kPublish_Name) {
+        send_name(x);
+    }
+    if (flags & kPublish_RxChannel) {
+        send_midi_rx_channel(x);
+    }
+    if (flags & kPublish_TxChannel) {
+        send_midi_tx_channel(x);
+    }
+    if (flags & kPublish_Algorithms) {
+        send_algorithms(x);
+    }
+    if (flags & kPublish_Algorithm) {
+        send_algorithm(x);
+    }
+    if (flags & kPublish_PresetName) {
+        send_preset_name(x);
+    }
+}
+
+// A set sub-command failed validation. Outside a transaction it has simply been ignored.
+static void txn_reject(t_h9_external *x) {
+    if (x->txn_depth > 0) {
+        x->txn_failed = true;
+    }
+}
+
+// Fires TXN_WARN_MS after the outermost begin, unless commit or abort came first.
+static void txn_held_open(t_h9_external *x) {
+    if (x->txn_depth > 0) {
+        LOG_WARNING(x, "Transaction open for over %d ms; all output is held until commit or abort.", TXN_WARN_MS);
+    }
+}
+
+static void txn_snapshot(t_h9_external *x) {
+    x->txn_snapshot_len = x->h9->preset->loaded ? h9_dump(x->h9, x->txn_snapshot, PRESET_DUMP_SZ, false) : 0;
+    if (x->txn_snapshot_len == 0) {
+        x->txn_module    = h9_currentModuleIndex(x->h9);
+        x->txn_algorithm = h9_currentAlgorithmIndex(x->h9);
+        for (size_t i = 0; i < NUM_CONTROLS; i++) {
+            x->txn_controls[i] = h9_controlValue(x->h9, (control_id)i);
+        }
+        for (size_t i = 0; i < H9_NUM_KNOBS; i++) {
+            h9_knobMap(x->h9, (control_id)i, &x->txn_exp_min[i], &x->txn_exp_max[i], &x->txn_psw[i]);
+        }
+    }
+    memcpy(x->txn_cc_rx_map, x->h9->midi_config.cc_rx_map, NUM_CONTROLS);
+    memcpy(x->txn_cc_tx_map, x->h9->midi_config.cc_tx_map, NUM_CONTROLS);
+    x->txn_sysex_id   = x->h9->midi_config.sysex_id;
+    x->txn_rx_channel = x->h9->midi_config.midi_rx_channel;
+    x->txn_tx_channel = x->h9->midi_config.midi_tx_channel;
+}
+
+// Call with the transaction still open, so the callbacks triggered by re-parsing stay held.
+static void txn_restore(t_h9_external *x) {
+    if (x->txn_snapshot_len > 0) {
+        h9_parse_sysex(x->h9, x->txn_snapshot, x->txn_snapshot_len, kH9_RESPOND_TO_ANY_SYSEX_ID);
+    } else {
+        h9_setAlgorithm(x->h9, x->txn_module, x->txn_algorithm);
+        for (size_t i = 0; i < NUM_CONTROLS; i++) {
+            h9_setControl(x->h9, (control_id)i, x->txn_controls[i], kH9_TRIGGER_CALLBACK);
+        }
+        for (size_t i = 0; i < H9_NUM_KNOBS; i++) {
+            h9_setKnobMap(x->h9, (control_id)i, x->txn_exp_min[i], x->txn_exp_max[i], x->txn_psw[i]);
+        }
+    }
+    memcpy(x->h9->midi_config.cc_rx_map, x->txn_cc_rx_map, NUM_CONTROLS);
+    memcpy(x->h9->midi_config.cc_tx_map, x->txn_cc_tx_map, NUM_CONTROLS);
+    x->h9->midi_config.sysex_id        = x->txn_sysex_id;
+    x->h9->midi_config.midi_rx_channel = x->txn_rx_channel;
+    x->h9->midi_config.midi_tx_channel = x->txn_tx_channel;
+    model_changed(x);
+}
+
+// Drops everything held and closes the transaction without output.
+static void txn_discard(t_h9_external *x) {
+    x->txn_depth   = 0;
+    x->txn_publish = kPublish_None;
+    x->txn_failed  = false;
+    x->txn_sysex->clear();
+    clock_unset(x->txn_clock);
+    for (size_t i = 0; i < NUM_MIDI_CCS; i++) {
+        x->txn_cc[i] = CC_NO_PENDING;
+    }
+    for (size_t i = 0; i < NUM_CONTROLS; i++) {
+        x->txn_control[i] = false;
+    }
+}
+
+// Puts the model back as it was at begin and drops everything held. The device never saw any of the
+// held output, so only the controls the transaction touched and the dirty flag need re-sending.
+static void txn_rollback(t_h9_external *x) {
+    txn_restore(x);
+    bool touched[NUM_CONTROLS];
+    memcpy(touched, x->txn_control, sizeof(touched));
+    txn_discard(x);
+    if (x->knobmode == kKnobMode_Normal) {
+        for (size_t i = 0; i < NUM_CONTROLS; i++) {
+            if (touched[i]) {
+                send_control(x, (control_id)i, h9_displayValue(x->h9, (control_id)i), h9_controlValue(x->h9, (control_id)i));
+            }
+        }
+    }
+    publish(x, kPublish_Dirty);
 }
 
 static void send_control(t_h9_external *x, control_id control, control_value current_value, control_value alternate_value) {
@@ -411,10 +930,16 @@ static bool validate_atom_as_cc(t_atom *atom, uint8_t *cc) {
     return true;
 }
 
-static void set_control(t_h9_external *x, long argc, t_atom *argv) {
+static bool set_control(t_h9_external *x, long argc, t_atom *argv) {
     if (argc >= 2 && atom_gettype(&argv[0]) == A_LONG && atom_gettype(&argv[1])) {
-        control_id    control   = (control_id)atom_getlong(&argv[0]);
-        control_value new_value = atom_getfloat(&argv[1]);
+        long          control_num = atom_getlong(&argv[0]);
+        control_id    control     = (control_id)control_num;
+        control_value new_value   = atom_getfloat(&argv[1]);
+
+        if (control_num < 0 || control_num >= NUM_CONTROLS) {
+            LOG_ERROR(x, "Set: Invalid control %ld.", control_num);
+            return false;
+        }
 
         if (control >= H9_NUM_KNOBS) {
             // It's not a knob, handle it separately
@@ -441,92 +966,114 @@ static void set_control(t_h9_external *x, long argc, t_atom *argv) {
                     h9_setControl(x->h9, control, new_value, kH9_TRIGGER_CALLBACK);
             }
         }
-        send_dirty(x);
+        model_changed(x);
+        publish(x, kPublish_Dirty);
+        return true;
     }
+    return false;
 }
 
-static void set_midi_cc(t_h9_external *x, uint8_t *cc_map, long argc, t_atom *argv) {
+static bool set_midi_cc(t_h9_external *x, uint8_t *cc_map, long argc, t_atom *argv) {
     uint8_t list[NUM_CONTROLS];
     if (argc == 2) {
         // [control, cc]
         if (atom_gettype(&argv[0]) != A_LONG) {
-            object_error((t_object *)x, "Set: control is not an integer");
-            return;
+            LOG_ERROR(x, "Set: control is not an integer");
+            return false;
         }
         long control = atom_getlong(&argv[0]);
-        validate_atom_as_cc(&argv[1], &cc_map[(control_id)control]);
+        if (control < 0 || control >= NUM_CONTROLS) {
+            LOG_ERROR(x, "Set: Invalid control %ld.", control);
+            return false;
+        }
+        return validate_atom_as_cc(&argv[1], &cc_map[(control_id)control]);
     } else if (argc >= NUM_CONTROLS) {
         for (size_t i = 0; i < NUM_CONTROLS; i++) {
             if (!validate_atom_as_cc(&argv[i], &list[i])) {
-                return;
+                return false;
             }
         }
         // Now that they're valid, assign them.
         for (size_t i = 0; i < NUM_CONTROLS; i++) {
             cc_map[(control_id)i] = list[i];
         }
-    } else {
-        /* skip */
+        return true;
     }
+    return false;
 }
-static void set_sysex_id(t_h9_external *x, long argc, t_atom *argv) {
+static bool set_sysex_id(t_h9_external *x, long argc, t_atom *argv) {
     if (argc > 0 && atom_gettype(argv) == A_LONG) {
         long id = atom_getlong(argv);
         if (id < 0 || id > 16) {
-            object_error((t_object *)x, "Set: Invalid SYSEX id %d.", id);
+            LOG_ERROR(x, "Set: Invalid SYSEX id %ld.", id);
+            return false;
         }
         x->h9->midi_config.sysex_id = (uint8_t)id;
+        model_changed(x);  // The sysex id is part of the dump header
+        return true;
     }
+    return false;
 }
 
-static void set_midi_rx_channel(t_h9_external *x, long argc, t_atom *argv) {
+static bool set_midi_rx_channel(t_h9_external *x, long argc, t_atom *argv) {
     if (argc > 0 && atom_gettype(argv) == A_LONG) {
         long channel = atom_getlong(argv);
         if (channel < 1 || channel > 16) {
-            object_error((t_object *)x, "Set: Invalid MIDI channel %d.", channel);
+            LOG_ERROR(x, "Set: Invalid MIDI channel %ld.", channel);
+            return false;
         }
         x->h9->midi_config.midi_rx_channel = (uint8_t)channel;
+        return true;
     }
+    return false;
 }
 
-static void set_midi_tx_channel(t_h9_external *x, long argc, t_atom *argv) {
+static bool set_midi_tx_channel(t_h9_external *x, long argc, t_atom *argv) {
     if (argc > 0 && atom_gettype(argv) == A_LONG) {
         long channel = atom_getlong(argv);
         if (channel < 1 || channel > 16) {
-            object_error((t_object *)x, "Set: Invalid MIDI channel %d.", channel);
+            LOG_ERROR(x, "Set: Invalid MIDI channel %ld.", channel);
+            return false;
         }
         x->h9->midi_config.midi_tx_channel = (uint8_t)channel;
+        return true;
     }
+    return false;
 }
 
-static void set_module(t_h9_external *x, long argc, t_atom *argv) {
+static bool set_module(t_h9_external *x, long argc, t_atom *argv) {
     if (argc > 0 && atom_gettype(argv) == A_LONG) {
         long mod_id = atom_getlong(argv);
         if (mod_id < 0 || mod_id >= H9_NUM_MODULES) {
-            object_error((t_object *)x, "Set: Bad argument for module: %d.", mod_id);
+            LOG_ERROR(x, "Set: Bad argument for module: %ld.", mod_id);
+            return false;
         }
         h9_setAlgorithm(x->h9, mod_id, 0);
-        send_algorithms(x);
-        send_algorithm(x);
-        send_dirty(x);
-    } else {
-        object_error((t_object *)x, "Bad argument for module.");
+        model_changed(x);
+        publish(x, kPublish_Algorithms | kPublish_Algorithm | kPublish_Dirty);
+        return true;
     }
+    LOG_ERROR(x, "Bad argument for module.");
+    return false;
 }
 
-static void set_algorithm(t_h9_external *x, long argc, t_atom *argv) {
+static bool set_algorithm(t_h9_external *x, long argc, t_atom *argv) {
     if (argc > 0 && atom_gettype(argv) == A_LONG) {
         long alg_id = atom_getlong(argv);
         if (alg_id < 0 || alg_id >= h9_currentModule(x->h9)->num_algorithms) {
-            object_error((t_object *)x, "Bad argument for algorithm: %d.", alg_id);
+            LOG_ERROR(x, "Bad argument for algorithm: %ld.", alg_id);
+            return false;
         }
-        if (!h9_setAlgorithm(x->h9, h9_currentModuleIndex(x->h9), alg_id)) {
-            object_error((t_object *)x, "Could not set algorithm %d for module $d (out of %d total).", alg_id, h9_currentModule(x->h9), h9_currentModule(x->h9)->num_algorithms);
+        bool ok = h9_setAlgorithm(x->h9, h9_currentModuleIndex(x->h9), alg_id);
+        if (!ok) {
+            LOG_ERROR(x, "Could not set algorithm %ld for module %ld (out of %ld total).", alg_id, (long)h9_currentModuleIndex(x->h9), (long)h9_currentModule(x->h9)->num_algorithms);
         }
-        send_dirty(x);
-    } else {
-        object_error((t_object *)x, "Bad argument for algorithm.");
+        model_changed(x);
+        publish(x, kPublish_Dirty);
+        return ok;
     }
+    LOG_ERROR(x, "Bad argument for algorithm.");
+    return false;
 }
 
 static void set_knobmode(t_h9_external *x, long argc, t_atom *argv) {
@@ -552,12 +1099,641 @@ static void set_knobmode(t_h9_external *x, long argc, t_atom *argv) {
     }
 }
 
-static void set_preset_name(t_h9_external *x, long argc, t_atom *argv) {
+static bool set_preset_name(t_h9_external *x, long argc, t_atom *argv) {
     if (argc > 0 && atom_gettype(argv) == A_SYM) {
         t_symbol *preset_name = atom_getsym(argv);
         h9_setPresetName(x->h9, preset_name->s_name, strnlen(preset_name->s_name, H9_MAX_NAME_LEN));
-        send_preset_name(x);  // Update the field to the actual name as parsed by the h9
+        model_changed(x);
+        publish(x, kPublish_PresetName);  // Update the field to the actual name as parsed by the h9
+        return true;
+    }
+    return false;
+}
+
+// Device presence watchdog
+
+static t_max_err watchdog_attr_set(t_h9_external *x, void *attr, long argc, t_atom *argv) {
+    if (argc > 0 && argv) {
+        x->watchdog_interval = std::max(0L, (long)atom_getlong(argv));
+        x->watchdog_delay    = x->watchdog_interval;
+        x->missed_probes     = 0;
+        x->probe_pending     = false;
+        if (x->watchdog_interval > 0) {
+            clock_delay(x->watchdog_clock, 0);
+        } else {
+            clock_unset(x->watchdog_clock);
+        }
+    }
+    return 0;
+}
+
+/* Runs every watchdog_delay ms while enabled.
+ * Any CC from the device counts as proof of life, so a busy link is never probed. Otherwise a single
+ * config variable request goes out. The interval doubles while the device is absent (up to
+ * watchdog_max) and while the only traffic is our own probe replies (up to a few base intervals,
+ * so an unplug is still noticed promptly).
+ */
+static void watchdog_tick(t_h9_external *x) {
+    if (x->watchdog_interval <= 0) {
+        return;
+    }
+    unsigned long now = systime_ms();
+
+    if (x->heard_since_tick) {
+        x->missed_probes = 0;
+    } else if (x->probe_pending) {
+        x->probe_pending = false;
+        x->missed_probes++;
+        if (x->device_online && x->missed_probes >= WATCHDOG_MISSES) {
+            x->device_online = false;
+            LOG_INFO(x, "Device went offline.");
+            send_online(x);
+        }
+    }
+
+    long ceiling = x->device_online ? std::min((long)x->watchdog_max, (long)x->watchdog_interval * WATCHDOG_ONLINE_FACTOR) : (long)x->watchdog_max;
+    if (x->traffic_since_tick) {
+        x->watchdog_delay = x->watchdog_interval;
+    } else {
+        x->watchdog_delay  = std::max((long)x->watchdog_interval, std::min(x->watchdog_delay * 2, ceiling));
+        x->probe_pending   = true;
+        x->probe_sent      = now;
+        x->capturing_probe = true;
+        h9_sysexRequestConfigVar(x->h9, (uint16_t)x->watchdog_variable);
+        x->capturing_probe = false;
+    }
+    x->heard_since_tick   = false;
+    x->traffic_since_tick = false;
+
+    clock_delay(x->watchdog_clock, x->watchdog_delay);
+}
+
+// The H9 answers a config variable request with a dump of the same key (ASCII hex) followed by its
+// value, under a different command byte than the request's.
+static bool watchdog_is_probe_reply(t_h9_external *x, const uint8_t *sysex, size_t len) {
+    const uint8_t *request = x->probe_request;
+    if (!x->probe_pending || x->probe_request_len <= SYSEX_HEADER_LEN || len <= SYSEX_HEADER_LEN) {
+        return false;
+    }
+    if (sysex[0] != SYSEX_START || sysex[1] != request[1] || sysex[2] != request[2] || sysex[4] == request[4]) {
+        return false;  // Not from an H9, or our own request looped back
+    }
+    size_t key = 0;
+    while (SYSEX_HEADER_LEN + key < x->probe_request_len && isxdigit(request[SYSEX_HEADER_LEN + key])) {
+        key++;
+    }
+    return key > 0 && len > SYSEX_HEADER_LEN + key && memcmp(&sysex[SYSEX_HEADER_LEN], &request[SYSEX_HEADER_LEN], key) == 0 && !isxdigit(sysex[SYSEX_HEADER_LEN + key]);
+}
+
+// Called for every CC from the device and every reply to the outstanding probe. Returns true if this
+// brought the device back online, in which case the caller must call watchdog_reconnected once it
+// has handled the message.
+static bool watchdog_heard(t_h9_external *x, bool probe_reply) {
+    if (x->watchdog_interval <= 0) {
+        return false;
+    }
+    unsigned long now   = systime_ms();
+    bool          reply = probe_reply && x->probe_pending;
+    x->last_heard       = now;
+    x->heard_since_tick = true;
+    if (reply) {
+        x->probe_pending = false;
+        x->latency       = (long)(now - x->probe_sent);
+    } else {
+        x->traffic_since_tick = true;
+    }
+
+    if (x->device_online) {
+        return false;
+    }
+    x->device_online  = true;
+    x->missed_probes  = 0;
+    x->watchdog_delay = x->watchdog_interval;
+    if (!reply) {
+        x->latency = 0;  // Noticed from ordinary traffic, so there is no round trip to report
+    }
+    return true;
+}
+
+static void watchdog_reconnected(t_h9_external *x) {
+    LOG_INFO(x, "Device online (%ld ms).", x->latency);
+    send_online(x);
+    watchdog_resync(x);
+    // Come back to the base rate straight away rather than waiting out the backoff.
+    clock_delay(x->watchdog_clock, x->watchdog_delay);
+}
+
+/* Only fetch what the reconnect may have changed:
+ * - the system config, if we never got it (the pedal's name doesn't change across a power cycle)
+ * - our preset, if it was edited while the pedal was away; otherwise whatever the pedal booted into.
+ *   Older unsaved edits don't count: the pedal may have been deliberately changed since.
+ */
+static void watchdog_resync(t_h9_external *x) {
+    bool push        = x->offline_edits && x->h9->preset->loaded;
+    x->offline_edits = false;
+    if (strnlen(x->h9->name, H9_MAX_NAME_LEN) == 0) {
+        request_device_config(x);
+    }
+    if (push) {
+        dump_preset(x);
+        publish(x, kPublish_Dirty);
+    } else {
+        request_device_program(x);
+    }
+}
+
+// online <probe latency ms> or offline <ms since last heard>
+static void send_online(t_h9_external *x) {
+    t_atom atom;
+    if (x->device_online) {
+        atom_setlong(&atom, x->latency);
+        output_state(x, gensym("online"), 1, &atom);
+    } else {
+        atom_setlong(&atom, (long)(systime_ms() - x->last_heard));
+        output_state(x, gensym("offline"), 1, &atom);
+    }
+}
+
+// Transport-synced automation
+
+static bool automation_active(automation *automation) {
+    for (size_t i = 0; i < NUM_CONTROLS; i++) {
+        if (!automation->lanes[i].ticks.empty()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Linear interpolation, holding the first and last values outside the lane. cursor remembers the
+// segment between calls so rendering a window in tick order walks each lane only once.
+static float automation_value_at(automation_lane *lane, double tick, size_t *cursor) {
+    size_t count = lane->ticks.size();
+    if (tick <= lane->ticks[0]) {
+        *cursor = 0;
+        return lane->values[0];
+    }
+    if (tick >= lane->ticks[count - 1]) {
+        *cursor = count - 1;
+        return lane->values[count - 1];
+    }
+    size_t i = std::min(*cursor, count - 2);
+    if (lane->ticks[i] > tick) {
+        i = 0;
+    }
+    while (lane->ticks[i + 1] < tick) {
+        i++;
+    }
+    *cursor = i;
+
+    double span = lane->ticks[i + 1] - lane->ticks[i];
+    if (span <= 0.0) {
+        return lane->values[i + 1];
+    }
+    return lane->values[i] + (float)((tick - lane->ticks[i]) / span) * (lane->values[i + 1] - lane->values[i]);
+}
+
+// Samples one lane every automation_grain ticks over [from, to) and appends an event wherever the
+// quantized CC value changes. Steady lanes produce nothing.
+static void automation_render(t_h9_external *x, size_t control, double from, double to, std::vector<automation_event> *out) {
+    automation_lane *lane = &x->automation->lanes[control];
+    if (lane->ticks.empty()) {
+        return;
+    }
+    double grain  = (double)std::max(1L, (long)x->automation_grain);
+    size_t cursor = 0;
+    for (double tick = from; tick < to; tick += grain) {
+        float   value     = automation_value_at(lane, tick, &cursor);
+        int16_t quantized = (int16_t)(std::min(1.0f, std::max(0.0f, value)) * 127.0f + 0.5f);
+        if (quantized != x->automation->rendered[control]) {
+            out->push_back(automation_event{tick, (uint8_t)control, (uint8_t)quantized});
+            x->automation->rendered[control] = quantized;
+        }
+    }
+}
+
+/* Throws away unfired events and re-renders up to the current window end.
+ * control < 0 means every lane (a seek): all pending events go, since the ones before the new
+ * position belong to the old one. Otherwise only that lane's events from tick 'from' on are touched
+ * (a lane edit). Tempo changes need nothing here: events are kept in ticks and converted to ms only
+ * when scheduling.
+ */
+static void automation_invalidate(t_h9_external *x, long control, double from) {
+    automation *                   automation = x->automation;
+    std::vector<automation_event> &kept       = automation->scratch;
+
+    kept.clear();
+    if (control >= 0) {
+        for (size_t i = automation->next_event; i < automation->events.size(); i++) {
+            automation_event &event = automation->events[i];
+            if (event.tick < from || event.control != control) {
+                kept.push_back(event);
+            }
+        }
+    }
+
+    if (control < 0) {
+        // After a seek, chase every lane to its value at the new position.
+        for (size_t i = 0; i < NUM_CONTROLS; i++) {
+            automation->fired[i]    = AUTOMATION_NONE;
+            automation->rendered[i] = AUTOMATION_NONE;
+        }
+        automation->rendered_to = from;
+    } else {
+        automation->rendered[control] = automation->fired[control];
+        automation_render(x, (size_t)control, from, automation->rendered_to, &kept);
+        std::sort(kept.begin(), kept.end(), automation_event_before);
+    }
+    automation->events.swap(kept);
+    automation->next_event = 0;
+}
+
+/* The one clock that drives automation. Each wake it checks the transport, fires everything that is
+ * due, tops up the look-ahead window in a single batch, and sleeps until the next event (or half a
+ * window, so seeks and tempo changes are picked up promptly). Values are applied right here, so
+ * CCs go out on the scheduler's timing rather than whenever the main thread gets round to it.
+ */
+static void automation_tick(t_h9_external *x) {
+    automation *automation = x->automation;
+    if (!x->automation_running) {
+        return;
+    }
+
+    double lookahead_ms = (double)std::max(10L, (long)x->lookahead);
+    if (!itm_getstate(x->itm)) {
+        clock_fdelay(x->automation_clock, lookahead_ms / 2.0);
+        return;
+    }
+
+    // Lane edits can arrive from the main thread while this runs in the scheduler.
+    critical_enter(x->automation_lock);
+    double now = itm_getticks(x->itm);
+    if (now < automation->last_ticks || now > automation->rendered_to) {
+        automation_invalidate(x, -1, now);
+    }
+    automation->last_ticks = now;
+
+    // Several due events for one control collapse to the latest.
+    int16_t due[NUM_CONTROLS];
+    for (size_t i = 0; i < NUM_CONTROLS; i++) {
+        due[i] = AUTOMATION_NONE;
+    }
+    while (automation->next_event < automation->events.size() && automation->events[automation->next_event].tick <= now) {
+        automation_event &event = automation->events[automation->next_event++];
+        due[event.control]      = event.value;
+    }
+    for (size_t i = 0; i < NUM_CONTROLS; i++) {
+        if (due[i] == automation->fired[i]) {
+            due[i] = AUTOMATION_NONE;
+        } else if (due[i] != AUTOMATION_NONE) {
+            automation->fired[i] = due[i];
+        }
+    }
+    if (automation->next_event > automation->events.size() / 2) {
+        automation->events.erase(automation->events.begin(), automation->events.begin() + automation->next_event);
+        automation->next_event = 0;
+    }
+
+    double window_ticks = itm_mstoticks(x->itm, lookahead_ms);
+    double window_end   = now + window_ticks;
+    if (automation->rendered_to < now + window_ticks / 2.0) {
+        std::vector<automation_event> &rendered = automation->scratch;
+        rendered.clear();
+        for (size_t i = 0; i < NUM_CONTROLS; i++) {
+            automation_render(x, i, automation->rendered_to, window_end, &rendered);
+        }
+        std::sort(rendered.begin(), rendered.end(), automation_event_before);
+        automation->events.insert(automation->events.end(), rendered.begin(), rendered.end());
+        automation->rendered_to = window_end;
+    }
+
+    double delay_ms = lookahead_ms / 2.0;
+    if (automation->next_event < automation->events.size()) {
+        delay_ms = std::min(delay_ms, itm_tickstoms(x->itm, automation->events[automation->next_event].tick - now));
+    }
+    critical_exit(x->automation_lock);
+
+    // Outlets fire outside the critical region. Same path as a CC from the device in input_midi.
+    for (size_t i = 0; i < NUM_CONTROLS; i++) {
+        if (due[i] != AUTOMATION_NONE) {
+            h9_setControl(x->h9, (control_id)i, (control_value)due[i] / 127.0f, kH9_TRIGGER_CALLBACK);
+            model_changed(x);
+        }
+    }
+    clock_fdelay(x->automation_clock, std::max(1.0, delay_ms));
+}
+
+// automation lane <control> [<ticks> <value>]... replaces a whole lane; no pairs clears it.
+static void automation_set_lane(t_h9_external *x, long argc, t_atom *argv) {
+    if (argc < 1 || atom_gettype(argv) != A_LONG || atom_getlong(argv) < 0 || atom_getlong(argv) >= NUM_CONTROLS || (argc - 1) % 2 != 0) {
+        LOG_ERROR(x, "Automation: lane needs a control and tick/value pairs.");
+        return;
+    }
+    long            control = atom_getlong(argv);
+    automation_lane lane;
+    for (long i = 1; i + 1 < argc; i += 2) {
+        double tick = atom_getfloat(&argv[i]);
+        if (!lane.ticks.empty() && tick < lane.ticks.back()) {
+            LOG_ERROR(x, "Automation: lane points must be in time order.");
+            return;
+        }
+        lane.ticks.push_back(tick);
+        lane.values.push_back((float)atom_getfloat(&argv[i + 1]));
+    }
+    x->automation->lanes[control] = lane;
+    automation_invalidate(x, control, x->automation->last_ticks);
+}
+
+// automation point <control> <ticks> <value> adds a breakpoint, replacing one at the same tick.
+static void automation_add_point(t_h9_external *x, long argc, t_atom *argv) {
+    if (argc < 3 || atom_gettype(argv) != A_LONG || atom_getlong(argv) < 0 || atom_getlong(argv) >= NUM_CONTROLS) {
+        LOG_ERROR(x, "Automation: point needs a control, ticks and value.");
+        return;
+    }
+    long             control = atom_getlong(argv);
+    double           tick    = atom_getfloat(&argv[1]);
+    float            value   = (float)atom_getfloat(&argv[2]);
+    automation_lane *lane    = &x->automation->lanes[control];
+
+    size_t i = (size_t)(std::lower_bound(lane->ticks.begin(), lane->ticks.end(), tick) - lane->ticks.begin());
+    if (i < lane->ticks.size() && lane->ticks[i] == tick) {
+        lane->values[i] = value;
+    } else {
+        lane->ticks.insert(lane->ticks.begin() + i, tick);
+        lane->values.insert(lane->values.begin() + i, value);
+    }
+    automation_invalidate(x, control, x->automation->last_ticks);
+}
+
+// Preset similarity index
+
+// Everything is already 0..1, but clamp so a stray value can't dominate the distance.
+static void preset_vector(h9 *h9obj, float *vector) {
+    for (size_t i = 0; i < NUM_CONTROLS; i++) {
+        vector[i] = h9_controlValue(h9obj, (control_id)i);
+    }
+    for (size_t i = 0; i < H9_NUM_KNOBS; i++) {
+        control_value exp_min;
+        control_value exp_max;
+        control_value psw;
+        h9_knobMap(h9obj, (control_id)i, &exp_min, &exp_max, &psw);
+        vector[NUM_CONTROLS + i]                    = exp_min;
+        vector[NUM_CONTROLS + H9_NUM_KNOBS + i]     = exp_max;
+        vector[NUM_CONTROLS + 2 * H9_NUM_KNOBS + i] = psw;
+    }
+    for (size_t d = 0; d < INDEX_DIMS; d++) {
+        vector[d] = std::min(1.0f, std::max(0.0f, vector[d]));
+    }
+}
+
+static index_key index_label_key(t_atom *label) {
+    if (atom_gettype(label) == A_SYM) {
+        return index_key(A_SYM, (intptr_t)atom_getsym(label));
     }
+    return index_key(A_LONG, (intptr_t)atom_getlong(label));
+}
+
+static void index_remove(preset_index *index, t_atom *label) {
+    auto found = index->locations.find(index_label_key(label));
+    if (found == index->locations.end()) {
+        return;
+    }
+    index_partition &partition = index->partitions[found->second.partition];
+    size_t           row       = found->second.row;
+    size_t           last      = partition.labels.size() - 1;
+    index->locations.erase(found);
+
+    // Order within a partition doesn't matter, so swap the last entry in.
+    if (row != last) {
+        partition.labels[row]                                         = partition.labels[last];
+        index->locations[index_label_key(&partition.labels[row])].row = row;
+    }
+    partition.labels.pop_back();
+    for (size_t d = 0; d < INDEX_DIMS; d++) {
+        partition.columns[d][row] = partition.columns[d][last];
+        partition.columns[d].pop_back();
+    }
+}
+
+static void index_insert(preset_index *index, t_atom *label, uint8_t module, uint8_t algorithm, const float *vector) {
+    size_t p = 0;
+    while (p < index->partitions.size() && !(index->partitions[p].module == module && index->partitions[p].algorithm == algorithm)) {
+        p++;
+    }
+    if (p == index->partitions.size()) {
+        index->partitions.emplace_back();
+        index->partitions[p].module    = module;
+        index->partitions[p].algorithm = algorithm;
+    }
+    index_partition *partition               = &index->partitions[p];
+    index->locations[index_label_key(label)] = index_location{p, partition->labels.size()};
+    partition->labels.push_back(*label);
+    for (size_t d = 0; d < INDEX_DIMS; d++) {
+        partition->columns[d].push_back(vector[d]);
+    }
+}
+
+// Squared euclidean distance from query to every row, one column at a time. The inner loop has no
+// dependencies between rows, so the compiler vectorizes it for whatever the target supports.
+static void index_distances(const index_partition *partition, const float *query, float *__restrict distances) {
+    size_t count = partition->labels.size();
+    std::fill(distances, distances + count, 0.0f);
+    for (size_t d = 0; d < INDEX_DIMS; d++) {
+        const float *__restrict column = partition->columns[d].data();
+        const float             q      = query[d];
+        for (size_t i = 0; i < count; i++) {
+            float diff = column[i] - q;
+            distances[i] += diff * diff;
+        }
+    }
+}
+
+// Fills results with up to k labels, nearest first. Returns how many were found.
+static size_t index_query(preset_index *index, uint8_t module, uint8_t algorithm, const float *query, size_t k, t_atom *results) {
+    const index_partition *partition = NULL;
+    for (const index_partition &candidate : index->partitions) {
+        if (candidate.module == module && candidate.algorithm == algorithm) {
+            partition = &candidate;
+            break;
+        }
+    }
+    if (partition == NULL || partition->labels.empty()) {
+        return 0;
+    }
+
+    size_t count = partition->labels.size();
+    index->distances.resize(count);
+    index->order.resize(count);
+    index_distances(partition, query, index->distances.data());
+
+    k                      = std::min(k, count);
+    const float *distances = index->distances.data();
+    for (size_t i = 0; i < count; i++) {
+        index->order[i] = (uint32_t)i;
+    }
+    auto nearer = [distances](uint32_t a, uint32_t b) { return distances[a] < distances[b]; };
+    std::nth_element(index->order.begin(), index->order.begin() + (k - 1), index->order.end(), nearer);
+    std::sort(index->order.begin(), index->order.begin() + k, nearer);
+
+    for (size_t i = 0; i < k; i++) {
+        results[i] = partition->labels[index->order[i]];
+    }
+    return k;
+}
+
+// index add <label>: index the currently loaded preset under a slot number or name.
+static void index_add_current(t_h9_external *x, long argc, t_atom *argv) {
+    if (argc < 1 || (atom_gettype(argv) != A_LONG && atom_gettype(argv) != A_SYM)) {
+        LOG_ERROR(x, "Index: add needs a slot number or name.");
+        return;
+    }
+    if (!x->h9->preset->loaded) {
+        LOG_WARNING(x, "Index: no preset loaded, nothing to add.");
+        return;
+    }
+    float vector[INDEX_DIMS];
+    preset_vector(x->h9, vector);
+    index_remove(x->index, argv);
+    index_insert(x->index, argv, h9_currentModuleIndex(x->h9), h9_currentAlgorithmIndex(x->h9), vector);
+}
+
+static bool has_syx_extension(const char *filename) {
+    const char *ext = ".syx";
+    size_t      len = strlen(filename);
+    if (len < 4) {
+        return false;
+    }
+    for (size_t i = 0; i < 4; i++) {
+        if (tolower((unsigned char)filename[len - 4 + i]) != ext[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Parses every .syx file in the folder (and below) with a scratch h9, collecting into x->index_scan.
+ * Runs on its own thread, since a large library takes far too long for the main thread; nothing here
+ * touches the live model or the index.
+ */
+static void index_scan_folder(t_h9_external *x, h9 *scratch, short path, const char *prefix) {
+    void *folder = path_openfolder(path);
+    if (folder == NULL) {
+        LOG_ERROR(x, "Index: cannot open folder %s.", prefix);
+        return;
+    }
+
+    t_fourcc type;
+    char     filename[MAX_PATH_CHARS];
+    uint8_t *buffer = reinterpret_cast<uint8_t *>(malloc(MAX_PRESET_FILE_SZ));
+    while (buffer != NULL && !x->index_cancel && path_foldernextfile(folder, &type, filename, false)) {
+        char label[MAX_PATH_CHARS];
+        snprintf(label, MAX_PATH_CHARS, "%s%s", prefix, filename);
+
+        if (type == FOUR_CHAR_CODE('fold')) {
+            char  subfolder[MAX_PATH_CHARS];
+            char  unused[MAX_PATH_CHARS];
+            short subpath;
+            strncat(label, "/", MAX_PATH_CHARS - strlen(label) - 1);
+            if (path_topathname(path, filename, subfolder) == 0 && path_frompathname(subfolder, &subpath, unused) == 0) {
+                index_scan_folder(x, scratch, subpath, label);
+            }
+            continue;
+        }
+
+        if (!has_syx_extension(filename)) {
+            continue;
+        }
+
+        t_filehandle fh;
+        t_ptr_size   size = 0;
+        if (path_opensysfile(filename, path, &fh, READ_PERM) != 0) {
+            continue;
+        }
+        if (sysfile_geteof(fh, &size) != 0 || size > MAX_PRESET_FILE_SZ || sysfile_read(fh, &size, buffer) != 0) {
+            sysfile_close(fh);
+            LOG_WARNING(x, "Index: could not read %s.", label);
+            continue;
+        }
+        sysfile_close(fh);
+
+        // Banks may hold several presets; the second and later get their position appended.
+        size_t presets = 0;
+        for (const std::pair<size_t, size_t> &message : split_sysex(buffer, (size_t)size)) {
+            scratch->preset->loaded = false;
+            if (h9_parse_sysex(scratch, &buffer[message.first], message.second, kH9_RESPOND_TO_ANY_SYSEX_ID) != kH9_OK || !scratch->preset->loaded) {
+                continue;
+            }
+            index_entry entry;
+            if (presets == 0) {
+                entry.label = gensym(label);
+            } else {
+                char numbered[MAX_PATH_CHARS];
+                snprintf(numbered, MAX_PATH_CHARS, "%s:%zu", label, presets);
+                entry.label = gensym(numbered);
+            }
+            entry.module    = h9_currentModuleIndex(scratch);
+            entry.algorithm = h9_currentAlgorithmIndex(scratch);
+            preset_vector(scratch, entry.vector);
+            x->index_scan->push_back(entry);
+            presets++;
+        }
+        if (presets == 0) {
+            LOG_INFO(x, "Index: no valid presets in %s.", label);
+        }
+    }
+    free(buffer);
+    path_closefolder(folder);
+}
+
+static void *index_scan_thread(t_h9_external *x) {
+    h9 *scratch = h9_new();
+    if (scratch == NULL) {
+        LOG_ERROR(x, "Index: ran out of memory.");
+    } else {
+        index_scan_folder(x, scratch, x->index_path, "");
+        h9_delete(scratch);
+    }
+    qelem_set(x->index_qelem);
+    systhread_exit(0);
+    return NULL;
+}
+
+// Runs as a qelem on the main thread once the scan thread is done, and merges everything it found.
+static void index_scan_done(t_h9_external *x) {
+    unsigned int ret;
+    systhread_join(x->index_thread, &ret);
+    x->index_thread = NULL;
+
+    if (!x->index_cancel) {
+        for (const index_entry &entry : *x->index_scan) {
+            t_atom atom;
+            atom_setsym(&atom, entry.label);
+            index_remove(x->index, &atom);
+            index_insert(x->index, &atom, entry.module, entry.algorithm, entry.vector);
+        }
+        LOG_INFO(x, "Index: added %zu presets from folder.", x->index_scan->size());
+    }
+    delete x->index_scan;
+    x->index_scan = NULL;
+    send_index_size(x);
+}
+
+// Abandons a running scan and waits for its thread. Only for teardown; index clear just sets index_cancel.
+static void index_scan_stop(t_h9_external *x) {
+    if (x->index_thread) {
+        unsigned int ret;
+        x->index_cancel = true;
+        systhread_join(x->index_thread, &ret);
+        x->index_thread = NULL;
+    }
+    delete x->index_scan;
+    x->index_scan = NULL;
+}
+
+static void send_index_size(t_h9_external *x) {
+    t_atom atom;
+    atom_setlong(&atom, (long)x->index->locations.size());
+    output_state(x, gensym("index_size"), 1, &atom);
 }
 
 /* ============================ PUBLIC function definitions ======================================*/
@@ -574,6 +1750,12 @@ void ext_main(void *r) {
     class_addmethod(c, (method)h9_external_set, "set", A_GIMME, 0);
     class_addmethod(c, (method)h9_external_list, "list", A_GIMME, 0);
     class_addmethod(c, (method)h9_external_get, "get", A_GIMME, 0);
+    class_addmethod(c, (method)h9_external_index, "index", A_GIMME, 0);
+    class_addmethod(c, (method)h9_external_begin, "begin", 0);
+    class_addmethod(c, (method)h9_external_commit, "commit", 0);
+    class_addmethod(c, (method)h9_external_abort, "abort", 0);
+    class_addmethod(c, (method)h9_external_automation, "automation", A_GIMME, 0);
+    class_addmethod(c, (method)h9_external_find_similar, "find_similar", A_LONG, 0);
     CLASS_METHOD_ATTR_PARSE(c, "identify", "undocumented", gensym("long"), 0, "1");
 
     /* you CAN'T call this from the patcher */
@@ -581,6 +1763,27 @@ void ext_main(void *r) {
 
     CLASS_ATTR_SYM(c, "name", 0, t_h9_external, name);
 
+    CLASS_ATTR_LONG(c, "loglevel", 0, t_h9_external, loglevel);
+    CLASS_ATTR_ENUMINDEX(c, "loglevel", 0, "off error warning info debug");
+    CLASS_ATTR_FILTER_CLIP(c, "loglevel", kLogLevel_Off, kLogLevel_Debug);
+    CLASS_ATTR_LABEL(c, "loglevel", 0, "Console Log Level");
+
+    CLASS_ATTR_LONG(c, "watchdog", 0, t_h9_external, watchdog_interval);
+    CLASS_ATTR_ACCESSORS(c, "watchdog", NULL, watchdog_attr_set);
+    CLASS_ATTR_LABEL(c, "watchdog", 0, "Device Poll Interval (ms, 0 = off)");
+    CLASS_ATTR_LONG(c, "watchdog_max", 0, t_h9_external, watchdog_max);
+    CLASS_ATTR_FILTER_MIN(c, "watchdog_max", 0);
+    CLASS_ATTR_LABEL(c, "watchdog_max", 0, "Device Poll Backoff Limit (ms)");
+    CLASS_ATTR_LONG(c, "watchdog_variable", 0, t_h9_external, watchdog_variable);
+    CLASS_ATTR_LABEL(c, "watchdog_variable", 0, "Device Poll Config Variable");
+
+    CLASS_ATTR_LONG(c, "lookahead", 0, t_h9_external, lookahead);
+    CLASS_ATTR_FILTER_MIN(c, "lookahead", 10);
+    CLASS_ATTR_LABEL(c, "lookahead", 0, "Automation Look-ahead (ms)");
+    CLASS_ATTR_LONG(c, "automation_grain", 0, t_h9_external, automation_grain);
+    CLASS_ATTR_FILTER_MIN(c, "automation_grain", 1);
+    CLASS_ATTR_LABEL(c, "automation_grain", 0, "Automation Resolution (ticks)");
+
     class_register(CLASS_BOX, c);
     h9_external_class = c;
 }
@@ -590,12 +1793,16 @@ void *h9_external_new(t_symbol *s, long argc, t_atom *argv) {
 
     if ((x = (t_h9_external *)object_alloc(h9_external_class))) {
         x->name = gensym("");
-        if (argc && argv) {
+        if (argc && argv && attr_args_offset((short)argc, argv) > 0) {
             x->name = atom_getsym(argv);
         }
         if (!x->name || x->name == gensym(""))
             x->name = symbol_unique();
 
+        x->loglevel  = kLogLevel_Warning;
+        x->log_qelem = qelem_new(x, (method)log_flush);
+        log_init(x);
+
         x->proxy_list_controls = proxy_new((t_object *)x, 1, &x->proxy_num);
 
         x->m_outlet_enabled = outlet_new((t_object *)x, "int");
@@ -611,10 +1818,43 @@ void *h9_external_new(t_symbol *s, long argc, t_atom *argv) {
         x->h9->sysex_callback   = h9_sysex_callback_handler;
         x->h9->callback_context = x;
 
+        x->index        = new preset_index;
+        x->index_thread = NULL;
+        x->index_qelem  = qelem_new(x, (method)index_scan_done);
+        x->index_cancel = false;
+        x->index_scan   = NULL;
+
+        x->watchdog_clock    = clock_new(x, (method)watchdog_tick);
+        x->watchdog_interval = 0;
+        x->watchdog_max      = 30000;
+        x->watchdog_variable = 0;
+        x->device_online     = false;
+        x->offline_edits     = false;
+
+        x->txn_clock = clock_new(x, (method)txn_held_open);
+        x->txn_sysex = new std::vector<uint8_t>();
+        txn_discard(x);
+
+        x->automation       = new automation();
+        x->itm              = (t_itm *)itm_getglobal();
+        x->automation_clock = clock_new(x, (method)automation_tick);
+        x->lookahead        = 250;
+        x->automation_grain = 10;
+        itm_reference(x->itm);
+        critical_new(&x->automation_lock);
+        automation_invalidate(x, -1, 0.0);
+
+        x->generation      = 1;
+        x->dump_generation = 0;  // Nothing cached yet
+        x->dump_busy       = false;
+        x->dump_len        = 0;
+
         if (x->h9 == NULL) {
             h9_external_free(x);
             object_free(x);
             x = NULL;
+        } else {
+            attr_args_process(x, argc, argv);
         }
     }
 
@@ -651,6 +1891,37 @@ void h9_external_assist(t_h9_external *x, void *b, long m, long a, char *s) {
 }
 
 void h9_external_free(t_h9_external *x) {
+    // Stop everything that can log before the log qelem goes away.
+    if (x->watchdog_clock) {
+        clock_unset(x->watchdog_clock);
+        object_free(x->watchdog_clock);
+    }
+    if (x->automation_clock) {
+        clock_unset(x->automation_clock);
+        object_free(x->automation_clock);
+    }
+    if (x->automation_lock) {
+        critical_free(x->automation_lock);
+    }
+    if (x->txn_clock) {
+        clock_unset(x->txn_clock);
+        object_free(x->txn_clock);
+    }
+    index_scan_stop(x);
+    if (x->index_qelem) {
+        qelem_free(x->index_qelem);
+    }
+    if (x->log_qelem) {
+        qelem_free(x->log_qelem);
+        x->log_qelem = NULL;
+        log_flush(x);  // Anything still queued
+    }
+    if (x->itm) {
+        itm_dereference(x->itm);
+    }
+    delete x->automation;
+    delete x->txn_sysex;
+    delete x->index;
     h9_delete(x->h9);
 }
 
@@ -674,7 +1945,7 @@ void h9_external_list(t_h9_external *x, t_symbol *s, long argc, t_atom *argv) {
             input_control(x, argc, argv);
             break;
         default:
-            object_post((t_object *)x, "list received in inlet %d", inlet);
+            LOG_DEBUG(x, "list received in inlet %ld", inlet);
             break;
     }
 }
@@ -683,13 +1954,14 @@ void h9_external_set(t_h9_external *x, t_symbol *s, long argc, t_atom *argv) {
     t_symbol *sym  = atom_getsym(argv);
     long      optc = argc - 1;
     t_atom *  opts = &argv[1];
+    bool      ok   = true;
 
     switch (atom_gettype(argv)) {
         case A_LONG:
-            object_post((t_object *)x, "SET: Integer %ld", atom_getlong(argv));
+            LOG_INFO(x, "SET: Integer %ld", atom_getlong(argv));
             break;
         case A_FLOAT:
-            object_post((t_object *)x, "SET: Float %.2f", atom_getfloat(argv));
+            LOG_INFO(x, "SET: Float %.2f", atom_getfloat(argv));
             break;
         case A_SYM:
             if (sym == gensym("xyzzy")) {
@@ -697,34 +1969,39 @@ void h9_external_set(t_h9_external *x, t_symbol *s, long argc, t_atom *argv) {
             } else if (sym == gensym("knobmode")) {
                 set_knobmode(x, optc, opts);
             } else if (sym == gensym("midi_rx_cc")) {
-                set_midi_cc(x, x->h9->midi_config.cc_rx_map, optc, opts);
+                ok = set_midi_cc(x, x->h9->midi_config.cc_rx_map, optc, opts);
             } else if (sym == gensym("midi_tx_cc")) {
-                set_midi_cc(x, x->h9->midi_config.cc_tx_map, optc, opts);
+                ok = set_midi_cc(x, x->h9->midi_config.cc_tx_map, optc, opts);
             } else if (sym == gensym("id")) {
-                set_sysex_id(x, optc, opts);
+                ok = set_sysex_id(x, optc, opts);
             } else if (sym == gensym("channels")) {
-                set_midi_rx_channel(x, optc, opts);
-                set_midi_tx_channel(x, optc, opts);
+                ok = set_midi_rx_channel(x, optc, opts);
+                ok = set_midi_tx_channel(x, optc, opts) && ok;
             } else if (sym == gensym("rx_channel")) {
-                set_midi_rx_channel(x, optc, opts);
+                ok = set_midi_rx_channel(x, optc, opts);
             } else if (sym == gensym("tx_channel")) {
-                set_midi_tx_channel(x, optc, opts);
+                ok = set_midi_tx_channel(x, optc, opts);
             } else if (sym == gensym("module")) {
-                set_module(x, optc, opts);
+                ok = set_module(x, optc, opts);
             } else if (sym == gensym("algorithm")) {
-                set_algorithm(x, optc, opts);
+                ok = set_algorithm(x, optc, opts);
             } else if (sym == gensym("preset_name")) {
-                set_preset_name(x, optc, opts);
+                ok = set_preset_name(x, optc, opts);
             } else if (sym == gensym("system_variable")) {
                 set_device_variable(x, optc, opts);
             } else {
-                object_error((t_object *)x, "SET: Cannot set %s", sym->s_name);
+                LOG_ERROR(x, "SET: Cannot set %s", sym->s_name);
+                ok = false;
             }
             break;
         default:
-            object_post((t_object *)x, "SET: unknown atom type (%ld)", atom_gettype(argv));
+            LOG_WARNING(x, "SET: unknown atom type (%ld)", atom_gettype(argv));
+            ok = false;
             break;
     }
+    if (!ok) {
+        txn_reject(x);
+    }
 }
 
 void h9_external_get(t_h9_external *x, t_symbol *s, long argc, t_atom *argv) {
@@ -765,17 +2042,19 @@ void h9_external_get(t_h9_external *x, t_symbol *s, long argc, t_atom *argv) {
             request_device_program(x);
         } else if (sym == gensym("preset_name")) {
             send_preset_name(x);
+        } else if (sym == gensym("online")) {
+            send_online(x);
         } else if (sym == gensym("system_variable")) {
             request_device_variable(x, optc, opts);
         } else {
-            object_post((t_object *)x, "Get: Unsupported '%s'", sym->s_name);
+            LOG_WARNING(x, "Get: Unsupported '%s'", sym->s_name);
         }
     } else if (argc == 0) {
         const char *str = s->s_name;
-        object_error((t_object *)x, "Get: Cannot get %s", str);
+        LOG_ERROR(x, "Get: Cannot get %s", str);
     } else {
         // there are arguments but the first one is not a symbol
-        object_error((t_object *)x, "Get: invalid syntax");
+        LOG_ERROR(x, "Get: invalid syntax");
     }
 }
 
@@ -785,17 +2064,193 @@ void h9_external_get(t_h9_external *x, t_symbol *s, long argc, t_atom *argv) {
  * If there IS a loaded state, bang will dump the loaded preset and update the UI.
  */
 void h9_external_bang(t_h9_external *x) {
-    object_post((t_object *)x, "%s says \"Bang!\"", x->name->s_name);
+    LOG_DEBUG(x, "%s says \"Bang!\"", x->name->s_name);
     if (strnlen(x->h9->name, H9_MAX_NAME_LEN) == 0) {
         request_device_config(x);
     }
     if (x->h9->preset->loaded) {
         dump_preset(x);
     }
-    send_dirty(x);
-    send_module(x);
-    send_algorithms(x);
-    send_algorithm(x);
+    publish(x, kPublish_Dirty | kPublish_Module | kPublish_Algorithms | kPublish_Algorithm);
+}
+
+void h9_external_index(t_h9_external *x, t_symbol *s, long argc, t_atom *argv) {
+    if (argc > 0 && atom_gettype(argv) == A_SYM) {
+        t_symbol *sym  = atom_getsym(argv);
+        long      optc = argc - 1;
+        t_atom *  opts = &argv[1];
+        if (sym == gensym("add")) {
+            index_add_current(x, optc, opts);
+        } else if (sym == gensym("remove") && optc > 0) {
+            index_remove(x->index, opts);
+        } else if (sym == gensym("folder") && optc > 0 && atom_gettype(opts) == A_SYM) {
+            // Scanned in the background; index_size goes out again once the results are merged.
+            short path;
+            char  filename[MAX_PATH_CHARS];
+            if (x->index_thread) {
+                LOG_WARNING(x, "Index: already scanning a folder, try again when it is done.");
+                return;
+            }
+            if (path_frompathname(atom_getsym(opts)->s_name, &path, filename) != 0) {
+                LOG_ERROR(x, "Index: cannot find folder %s.", atom_getsym(opts)->s_name);
+                return;
+            }
+            x->index_path   = path;
+            x->index_cancel = false;
+            x->index_scan   = new std::vector<index_entry>();
+            if (systhread_create((method)index_scan_thread, x, 0, 0, 0, &x->index_thread) != 0) {
+                LOG_ERROR(x, "Index: could not start the folder scan.");
+                x->index_thread = NULL;
+                delete x->index_scan;
+                x->index_scan = NULL;
+                return;
+            }
+        } else if (sym == gensym("clear")) {
+            x->index->partitions.clear();
+            x->index->locations.clear();
+            if (x->index_thread) {
+                x->index_cancel = true;  // Don't merge a scan that started before the clear
+            }
+        } else if (sym != gensym("size")) {
+            LOG_ERROR(x, "Index: Unsupported '%s'", sym->s_name);
+            return;
+        }
+        send_index_size(x);
+    } else {
+        LOG_ERROR(x, "Index: invalid syntax");
+    }
+}
+
+// Outputs "similar <label> ..." with up to k indexed presets nearest to the current one, nearest first.
+// Only presets using the same module and algorithm are considered.
+void h9_external_find_similar(t_h9_external *x, long k) {
+    if (k < 1) {
+        LOG_ERROR(x, "find_similar: k must be at least 1.");
+        return;
+    }
+    if (!x->h9->preset->loaded) {
+        LOG_WARNING(x, "find_similar: no preset loaded.");
+        return;
+    }
+    float query[INDEX_DIMS];
+    preset_vector(x->h9, query);
+
+    // Never more results than there are presets, however large k is.
+    size_t              count = std::min((size_t)k, x->index->locations.size());
+    std::vector<t_atom> results(count);
+    size_t              found = count == 0 ? 0 : index_query(x->index, h9_currentModuleIndex(x->h9), h9_currentAlgorithmIndex(x->h9), query, count, results.data());
+    output_state(x, gensym("similar"), (long)found, results.data());
+}
+
+/* begin ... commit groups any number of set messages (and control lists) into one atomic edit.
+ * Sub-commands are validated and applied to the model as they arrive, but nothing goes out until
+ * the outermost commit. If any of them was rejected, commit restores the model as it was at begin
+ * and sends nothing to the device; otherwise held sysex (system variable writes) goes out, then each
+ * changed CC once with its final value, then one round of state messages including any requested
+ * dump. abort always rolls back.
+ */
+void h9_external_begin(t_h9_external *x) {
+    if (x->txn_depth++ == 0) {
+        txn_snapshot(x);
+        clock_delay(x->txn_clock, TXN_WARN_MS);
+    }
+}
+
+void h9_external_commit(t_h9_external *x) {
+    if (x->txn_depth == 0) {
+        LOG_WARNING(x, "commit without begin, ignored.");
+        return;
+    }
+    if (x->txn_depth > 1) {
+        x->txn_depth--;
+        return;
+    }
+    if (x->txn_failed) {
+        txn_rollback(x);
+        LOG_ERROR(x, "commit: a sub-command was rejected, transaction rolled back.");
+        return;
+    }
+    x->txn_depth = 0;
+    clock_unset(x->txn_clock);
+
+    for (const std::pair<size_t, size_t> &message : split_sysex(x->txn_sysex->data(), x->txn_sysex->size())) {
+        output_sysex(x, &(*x->txn_sysex)[message.first], message.second);
+    }
+    x->txn_sysex->clear();
+
+    t_atom list[2];
+    for (size_t cc = 0; cc < NUM_MIDI_CCS; cc++) {
+        if (x->txn_cc[cc] != CC_NO_PENDING) {
+            atom_setlong(&list[0], (long)cc);
+            atom_setlong(&list[1], x->txn_cc[cc]);
+            outlet_list(x->m_outlet_cc, gensym("list"), 2, list);
+            x->txn_cc[cc] = CC_NO_PENDING;
+        }
+    }
+    for (size_t i = 0; i < NUM_CONTROLS; i++) {
+        if (x->txn_control[i]) {
+            x->txn_control[i] = false;
+            if (x->knobmode == kKnobMode_Normal) {
+                send_control(x, (control_id)i, h9_displayValue(x->h9, (control_id)i), h9_controlValue(x->h9, (control_id)i));
+            }
+        }
+    }
+    uint32_t flags = x->txn_publish;
+    x->txn_publish = kPublish_None;
+    publish(x, flags);
+}
+
+void h9_external_abort(t_h9_external *x) {
+    if (x->txn_depth == 0) {
+        LOG_WARNING(x, "abort without begin, ignored.");
+        return;
+    }
+    txn_rollback(x);
+    LOG_WARNING(x, "abort: transaction rolled back.");
+}
+
+/* Breakpoint automation that follows the global transport:
+ *   automation point <control> <ticks> <value 0..1>
+ *   automation lane <control> [<ticks> <value>]...
+ *   automation clear [<control>]
+ * Values are sent through the H9 as the transport plays, as if set_control had been called.
+ */
+void h9_external_automation(t_h9_external *x, t_symbol *s, long argc, t_atom *argv) {
+    if (argc < 1 || atom_gettype(argv) != A_SYM) {
+        LOG_ERROR(x, "Automation: invalid syntax");
+        return;
+    }
+    t_symbol *sym  = atom_getsym(argv);
+    long      optc = argc - 1;
+    t_atom *  opts = &argv[1];
+
+    critical_enter(x->automation_lock);
+    if (sym == gensym("point")) {
+        automation_add_point(x, optc, opts);
+    } else if (sym == gensym("lane")) {
+        automation_set_lane(x, optc, opts);
+    } else if (sym == gensym("clear")) {
+        if (optc > 0 && atom_gettype(opts) == A_LONG && atom_getlong(opts) >= 0 && atom_getlong(opts) < NUM_CONTROLS) {
+            automation_set_lane(x, 1, opts);
+        } else {
+            for (size_t i = 0; i < NUM_CONTROLS; i++) {
+                x->automation->lanes[i] = automation_lane();
+            }
+            automation_invalidate(x, -1, x->automation->last_ticks);
+        }
+    } else {
+        LOG_ERROR(x, "Automation: Unsupported '%s'", sym->s_name);
+    }
+    bool active = automation_active(x->automation);
+    critical_exit(x->automation_lock);
+
+    if (active && !x->automation_running) {
+        x->automation_running = true;
+        clock_delay(x->automation_clock, 0);
+    } else if (!active && x->automation_running) {
+        x->automation_running = false;
+        clock_unset(x->automation_clock);
+    }
 }
 
 void h9_external_identify(t_h9_external *x) {
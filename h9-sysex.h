@@ -0,0 +1,47 @@
+/*  h9-sysex.h
+
+    Sysex framing shared by the Max external and the command line tools.
+    Copyright (C) 2020 Daniel Collins
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef H9_SYSEX_H
+#define H9_SYSEX_H
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#define SYSEX_START 0xF0
+#define SYSEX_END   0xF7
+
+// Splits a byte stream into complete F0 ... F7 messages, as (offset, length) pairs. Anything between
+// messages, and a message cut off by the end of the stream, is ignored.
+static inline std::vector<std::pair<size_t, size_t>> split_sysex(const uint8_t *bytes, size_t len) {
+    std::vector<std::pair<size_t, size_t>> messages;
+    size_t                                 start    = 0;
+    bool                                   in_sysex = false;
+    for (size_t i = 0; i < len; i++) {
+        if (bytes[i] == SYSEX_START) {
+            start    = i;
+            in_sysex = true;
+        } else if (bytes[i] == SYSEX_END && in_sysex) {
+            messages.emplace_back(start, i + 1 - start);
+            in_sysex = false;
+        }
+    }
+    return messages;
+}
+
+#endif  // H9_SYSEX_H
@@ -0,0 +1,518 @@
+/*  h9-audit.cpp
+
+    Command line preset library auditor for the H9, using the same libh9 ingest and dump
+    path as the Max external, without needing Max.
+    Copyright (C) 2020 Daniel Collins
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "h9-sysex.h"
+#include "libh9.h"
+
+namespace fs = std::filesystem;
+
+#define DUMP_BUFFER_SZ 1000  // Same as the external's dump_preset
+
+////////////////////////// types
+
+typedef struct preset_summary {
+    size_t        index;  // Which sysex message in the file this came from
+    uint8_t       module;
+    uint8_t       algorithm;
+    std::string   module_name;
+    std::string   algorithm_name;
+    std::string   name;
+    control_value controls[NUM_CONTROLS];
+    control_value exp_min[H9_NUM_KNOBS];
+    control_value exp_max[H9_NUM_KNOBS];
+    control_value psw[H9_NUM_KNOBS];
+} preset_summary;
+
+typedef struct message_error {
+    size_t      index;  // Which sysex message in the file failed
+    std::string error;
+} message_error;
+
+typedef struct file_result {
+    fs::path                    path;
+    fs::path                    relative;  // Output path under --normalize, mirroring the input tree
+    size_t                      messages;  // Sysex messages found in the file
+    std::vector<preset_summary> presets;
+    std::vector<message_error>  failures;  // Messages that did not yield a preset
+    std::vector<uint8_t>        normalized;
+    std::string                 error;     // Set if the file is invalid as a whole
+} file_result;
+
+typedef struct audit_options {
+    size_t   threads;
+    fs::path json_path;
+    fs::path csv_path;
+    fs::path normalize_dir;
+} audit_options;
+
+// Each worker owns a deque of file indices. It takes from the back of its own and steals from the
+// front of everyone else's, so uneven directories (a few huge banks, many single presets) still
+// spread across all cores.
+typedef struct work_queue {
+    std::mutex         lock;
+    std::deque<size_t> items;
+} work_queue;
+
+////////////////////////// ingest
+
+static bool read_file(const fs::path &path, std::vector<uint8_t> *bytes) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        return false;
+    }
+    bytes->assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    return !in.bad();
+}
+
+static void summarize(h9 *h9obj, size_t index, preset_summary *summary) {
+    summary->index          = index;
+    summary->module         = h9_currentModuleIndex(h9obj);
+    summary->algorithm      = h9_currentAlgorithmIndex(h9obj);
+    summary->module_name    = h9_currentModuleName(h9obj);
+    summary->algorithm_name = h9_currentAlgorithmName(h9obj);
+    summary->name           = std::string(h9obj->preset->name, strnlen(h9obj->preset->name, H9_MAX_NAME_LEN));
+    for (size_t i = 0; i < NUM_CONTROLS; i++) {
+        summary->controls[i] = h9_controlValue(h9obj, (control_id)i);
+    }
+    for (size_t i = 0; i < H9_NUM_KNOBS; i++) {
+        h9_knobMap(h9obj, (control_id)i, &summary->exp_min[i], &summary->exp_max[i], &summary->psw[i]);
+    }
+}
+
+static void audit_file(h9 *h9obj, file_result *result, bool normalize) {
+    std::vector<uint8_t> bytes;
+    if (!read_file(result->path, &bytes)) {
+        result->error = "could not read file";
+        return;
+    }
+
+    std::vector<std::pair<size_t, size_t>> messages = split_sysex(bytes.data(), bytes.size());
+    result->messages                                = messages.size();
+    if (messages.empty()) {
+        result->error = "no sysex found";
+        return;
+    }
+
+    for (size_t i = 0; i < messages.size(); i++) {
+        h9obj->preset->loaded = false;
+        if (h9_parse_sysex(h9obj, &bytes[messages[i].first], messages[i].second, kH9_RESPOND_TO_ANY_SYSEX_ID) != kH9_OK) {
+            result->failures.push_back(message_error{i, "sysex did not parse"});
+            continue;
+        }
+        if (!h9obj->preset->loaded) {
+            result->failures.push_back(message_error{i, "not a preset"});
+            continue;
+        }
+        preset_summary summary;
+        summarize(h9obj, i, &summary);
+        result->presets.push_back(summary);
+
+        if (normalize) {
+            uint8_t sysex_buffer[DUMP_BUFFER_SZ];
+            size_t  bytes_written = h9_dump(h9obj, sysex_buffer, DUMP_BUFFER_SZ, false);
+            result->normalized.insert(result->normalized.end(), sysex_buffer, sysex_buffer + bytes_written);
+        }
+    }
+    // One bad message fails the whole file, so a corrupt bank member can't slip through. Nothing is
+    // normalized from it either: a re-dump missing presets would look like a clean bank.
+    if (result->presets.empty()) {
+        result->error = "no valid presets";
+    } else if (!result->failures.empty()) {
+        result->error = std::to_string(result->failures.size()) + " of " + std::to_string(messages.size()) + " messages invalid";
+    }
+    if (!result->error.empty()) {
+        result->normalized.clear();
+    }
+}
+
+////////////////////////// thread pool
+
+static bool next_item(std::vector<work_queue> *queues, size_t self, size_t *item) {
+    {
+        work_queue                 &own = (*queues)[self];
+        std::lock_guard<std::mutex> guard(own.lock);
+        if (!own.items.empty()) {
+            *item = own.items.back();
+            own.items.pop_back();
+            return true;
+        }
+    }
+    for (size_t offset = 1; offset < queues->size(); offset++) {
+        work_queue                 &victim = (*queues)[(self + offset) % queues->size()];
+        std::lock_guard<std::mutex> guard(victim.lock);
+        if (!victim.items.empty()) {
+            *item = victim.items.front();
+            victim.items.pop_front();
+            return true;
+        }
+    }
+    return false;  // Nothing left anywhere; no new work is ever produced once started.
+}
+
+static bool worker(std::vector<work_queue> *queues, size_t self, std::vector<file_result> *results, bool normalize) {
+    h9 *h9obj = h9_new();
+    if (h9obj == NULL) {
+        return false;
+    }
+    h9obj->cc_callback      = NULL;
+    h9obj->display_callback = NULL;
+    h9obj->sysex_callback   = NULL;
+
+    size_t item;
+    while (next_item(queues, self, &item)) {
+        audit_file(h9obj, &(*results)[item], normalize);
+    }
+    h9_delete(h9obj);
+    return true;
+}
+
+static bool run_pool(std::vector<file_result> *results, size_t num_threads, bool normalize) {
+    num_threads = std::max<size_t>(1, std::min(num_threads, results->size()));
+    std::vector<work_queue> queues(num_threads);
+    for (size_t i = 0; i < results->size(); i++) {
+        queues[i % num_threads].items.push_back(i);
+    }
+
+    std::atomic<bool>        ok(true);
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < num_threads; t++) {
+        threads.emplace_back([&, t]() {
+            if (!worker(&queues, t, results, normalize)) {
+                ok = false;
+            }
+        });
+    }
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+    return ok;
+}
+
+////////////////////////// output
+
+static std::string json_escape(const std::string &in) {
+    std::string out;
+    for (char c : in) {
+        switch (c) {
+            case '"':
+                out += "\\\"";
+                break;
+            case '\\':
+                out += "\\\\";
+                break;
+            default:
+                if ((unsigned char)c < 0x20) {
+                    char escaped[8];
+                    snprintf(escaped, sizeof(escaped), "\\u%04x", (unsigned char)c);
+                    out += escaped;
+                } else {
+                    out += c;
+                }
+        }
+    }
+    return out;
+}
+
+static std::string csv_escape(const std::string &in) {
+    if (in.find_first_of(",\"\n") == std::string::npos) {
+        return in;
+    }
+    std::string out = "\"";
+    for (char c : in) {
+        out += c;
+        if (c == '"') {
+            out += '"';
+        }
+    }
+    return out + "\"";
+}
+
+static void write_floats(FILE *out, const control_value *values, size_t count) {
+    fputc('[', out);
+    for (size_t i = 0; i < count; i++) {
+        fprintf(out, "%s%g", i ? "," : "", values[i]);
+    }
+    fputc(']', out);
+}
+
+static void write_json(FILE *out, const std::vector<file_result> &results) {
+    fprintf(out, "[\n");
+    for (size_t f = 0; f < results.size(); f++) {
+        const file_result &result = results[f];
+        fprintf(out, "  {\"file\": \"%s\", \"messages\": %zu, \"valid\": %s", json_escape(result.path.string()).c_str(), result.messages, result.error.empty() ? "true" : "false");
+        if (!result.error.empty()) {
+            fprintf(out, ", \"error\": \"%s\"", json_escape(result.error).c_str());
+        }
+        fprintf(out, ", \"errors\": [");
+        for (size_t e = 0; e < result.failures.size(); e++) {
+            fprintf(out, "%s{\"index\": %zu, \"error\": \"%s\"}", e ? ", " : "", result.failures[e].index, json_escape(result.failures[e].error).c_str());
+        }
+        fprintf(out, "], \"presets\": [");
+        for (size_t p = 0; p < result.presets.size(); p++) {
+            const preset_summary &preset = result.presets[p];
+            fprintf(out,
+                    "%s\n    {\"index\": %zu, \"name\": \"%s\", \"module\": %u, \"module_name\": \"%s\", \"algorithm\": %u, \"algorithm_name\": \"%s\", \"controls\": ",
+                    p ? "," : "",
+                    preset.index,
+                    json_escape(preset.name).c_str(),
+                    preset.module,
+                    json_escape(preset.module_name).c_str(),
+                    preset.algorithm,
+                    json_escape(preset.algorithm_name).c_str());
+            write_floats(out, preset.controls, NUM_CONTROLS);
+            fprintf(out, ", \"exp_min\": ");
+            write_floats(out, preset.exp_min, H9_NUM_KNOBS);
+            fprintf(out, ", \"exp_max\": ");
+            write_floats(out, preset.exp_max, H9_NUM_KNOBS);
+            fprintf(out, ", \"psw\": ");
+            write_floats(out, preset.psw, H9_NUM_KNOBS);
+            fprintf(out, "}");
+        }
+        fprintf(out, "%s]}%s\n", result.presets.empty() ? "" : "\n  ", f + 1 < results.size() ? "," : "");
+    }
+    fprintf(out, "]\n");
+}
+
+// One row per sysex message, in file order, with failed messages marked invalid. Files with no
+// messages at all still get a row so they show up in the audit.
+static void write_csv(FILE *out, const std::vector<file_result> &results) {
+    fprintf(out, "file,index,valid,error,name,module,module_name,algorithm,algorithm_name");
+    for (size_t i = 0; i < NUM_CONTROLS; i++) {
+        fprintf(out, ",control_%zu", i);
+    }
+    for (size_t i = 0; i < H9_NUM_KNOBS; i++) {
+        fprintf(out, ",exp_min_%zu,exp_max_%zu,psw_%zu", i, i, i);
+    }
+    fputc('\n', out);
+
+    for (const file_result &result : results) {
+        std::string file = csv_escape(result.path.string());
+        if (result.presets.empty() && result.failures.empty()) {
+            fprintf(out, "%s,,0,%s\n", file.c_str(), csv_escape(result.error).c_str());
+            continue;
+        }
+        size_t failure = 0;
+        for (const preset_summary &preset : result.presets) {
+            for (; failure < result.failures.size() && result.failures[failure].index < preset.index; failure++) {
+                fprintf(out, "%s,%zu,0,%s\n", file.c_str(), result.failures[failure].index, csv_escape(result.failures[failure].error).c_str());
+            }
+            fprintf(out,
+                    "%s,%zu,1,,%s,%u,%s,%u,%s",
+                    file.c_str(),
+                    preset.index,
+                    csv_escape(preset.name).c_str(),
+                    preset.module,
+                    csv_escape(preset.module_name).c_str(),
+                    preset.algorithm,
+                    csv_escape(preset.algorithm_name).c_str());
+            for (size_t i = 0; i < NUM_CONTROLS; i++) {
+                fprintf(out, ",%g", preset.controls[i]);
+            }
+            for (size_t i = 0; i < H9_NUM_KNOBS; i++) {
+                fprintf(out, ",%g,%g,%g", preset.exp_min[i], preset.exp_max[i], preset.psw[i]);
+            }
+            fputc('\n', out);
+        }
+        for (; failure < result.failures.size(); failure++) {
+            fprintf(out, "%s,%zu,0,%s\n", file.c_str(), result.failures[failure].index, csv_escape(result.failures[failure].error).c_str());
+        }
+    }
+}
+
+static bool write_report(const fs::path &path, void (*writer)(FILE *, const std::vector<file_result> &), const std::vector<file_result> &results) {
+    if (path == "-") {
+        writer(stdout, results);
+        return true;
+    }
+    FILE *out = fopen(path.string().c_str(), "w");
+    if (out == NULL) {
+        fprintf(stderr, "h9-audit: cannot write %s\n", path.string().c_str());
+        return false;
+    }
+    writer(out, results);
+    fclose(out);
+    return true;
+}
+
+static bool write_normalized(const fs::path &dir, const std::vector<file_result> &results) {
+    bool ok = true;
+    for (const file_result &result : results) {
+        if (result.normalized.empty()) {
+            continue;
+        }
+        fs::path        target = dir / result.relative;
+        std::error_code ec;
+        fs::create_directories(target.parent_path(), ec);
+        std::ofstream out(target, std::ios::binary);
+        out.write(reinterpret_cast<const char *>(result.normalized.data()), result.normalized.size());
+        if (!out) {
+            fprintf(stderr, "h9-audit: cannot write %s\n", target.string().c_str());
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+////////////////////////// main
+
+static bool is_syx(const fs::path &path) {
+    std::string ext = path.extension().string();
+    std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c) { return (char)tolower(c); });
+    return ext == ".syx";
+}
+
+// With several roots, each directory's files are mirrored under the directory's own name so that
+// roots sharing a layout don't land on top of each other.
+static void collect(const fs::path &root, bool prefix_root, std::vector<file_result> *results) {
+    std::error_code ec;
+    if (fs::is_directory(root, ec)) {
+        fs::path prefix;
+        if (prefix_root) {
+            fs::path absolute = fs::absolute(root, ec).lexically_normal();
+            if (absolute.filename().empty()) {
+                absolute = absolute.parent_path();  // Trailing slash
+            }
+            prefix = absolute.filename();
+        }
+        for (fs::recursive_directory_iterator it(root, ec), end; it != end; it.increment(ec)) {
+            if (it->is_regular_file(ec) && is_syx(it->path())) {
+                results->push_back(file_result{it->path(), prefix / fs::relative(it->path(), root, ec), 0, {}, {}, {}, {}});
+            }
+        }
+    } else {
+        results->push_back(file_result{root, root.filename(), 0, {}, {}, {}, {}});
+    }
+}
+
+// Returns false (and names the culprits) if two inputs would be normalized to the same file.
+static bool check_targets(const std::vector<file_result> &results) {
+    std::vector<const file_result *> sorted;
+    for (const file_result &result : results) {
+        sorted.push_back(&result);
+    }
+    std::sort(sorted.begin(), sorted.end(), [](const file_result *a, const file_result *b) { return a->relative < b->relative; });
+
+    bool ok = true;
+    for (size_t i = 1; i < sorted.size(); i++) {
+        if (sorted[i]->relative == sorted[i - 1]->relative) {
+            fprintf(stderr,
+                    "h9-audit: %s and %s would both normalize to %s\n",
+                    sorted[i - 1]->path.string().c_str(),
+                    sorted[i]->path.string().c_str(),
+                    sorted[i]->relative.string().c_str());
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+static void usage(void) {
+    fprintf(stderr,
+            "usage: h9-audit [-j threads] [--json file] [--csv file] [--normalize dir] path...\n"
+            "  Parses every .syx file under each path (recursively for directories).\n"
+            "  --json/--csv write a summary per preset ('-' for stdout).\n"
+            "  --normalize re-dumps every valid file into dir, mirroring the input tree.\n"
+            "  Exits 1 if any file has a sysex message that is not a valid preset.\n");
+}
+
+int main(int argc, char **argv) {
+    audit_options          options = {std::max(1U, std::thread::hardware_concurrency()), {}, {}, {}};
+    std::vector<fs::path> roots;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if ((arg == "-j" || arg == "--json" || arg == "--csv" || arg == "--normalize") && i + 1 >= argc) {
+            usage();
+            return 2;
+        }
+        if (arg == "-j") {
+            options.threads = (size_t)std::max(1L, strtol(argv[++i], NULL, 10));
+        } else if (arg == "--json") {
+            options.json_path = argv[++i];
+        } else if (arg == "--csv") {
+            options.csv_path = argv[++i];
+        } else if (arg == "--normalize") {
+            options.normalize_dir = argv[++i];
+        } else if (arg == "-h" || arg == "--help") {
+            usage();
+            return 0;
+        } else {
+            roots.push_back(arg);
+        }
+    }
+    if (roots.empty()) {
+        usage();
+        return 2;
+    }
+
+    std::vector<file_result> results;
+    for (const fs::path &root : roots) {
+        collect(root, roots.size() > 1, &results);
+    }
+    if (!options.normalize_dir.empty() && !check_targets(results)) {
+        return 2;
+    }
+    std::sort(results.begin(), results.end(), [](const file_result &a, const file_result &b) { return a.path < b.path; });
+
+    if (!results.empty() && !run_pool(&results, options.threads, !options.normalize_dir.empty())) {
+        fprintf(stderr, "h9-audit: could not allocate an h9 instance\n");
+        return 2;
+    }
+
+    bool ok = true;
+    if (!options.json_path.empty()) {
+        ok &= write_report(options.json_path, write_json, results);
+    }
+    if (!options.csv_path.empty()) {
+        ok &= write_report(options.csv_path, write_csv, results);
+    }
+    if (!options.normalize_dir.empty()) {
+        ok &= write_normalized(options.normalize_dir, results);
+    }
+
+    size_t invalid = 0;
+    size_t presets = 0;
+    for (const file_result &result : results) {
+        presets += result.presets.size();
+        if (!result.error.empty()) {
+            invalid++;
+            fprintf(stderr, "%s: %s\n", result.path.string().c_str(), result.error.c_str());
+        }
+        for (const message_error &failure : result.failures) {
+            fprintf(stderr, "%s: message %zu: %s\n", result.path.string().c_str(), failure.index, failure.error.c_str());
+        }
+    }
+    fprintf(stderr, "h9-audit: %zu files, %zu presets, %zu invalid\n", results.size(), presets, invalid);
+
+    if (!ok) {
+        return 2;
+    }
+    return invalid > 0 ? 1 : 0;
+}